@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "test.h"
+
+/*
+ * Throughput benchmark for skull.
+ * For every combination of engine, quantum, qset, io size, access pattern and read/write mix
+ * it runs a fixed number of operations and prints one CSV line with MB/s, ops/s and
+ * latency percentiles. It needs to run as root because it changes the geometry.
+ */
+
+#define MAX_LIST 16
+
+struct int_list {
+    int values[MAX_LIST];
+    int len;
+};
+
+struct run {
+    int engine, quantum, qset, ioSize, random, readPct;
+};
+
+static const char* device = "/dev/skull0";
+static long workingSet = 1 << 20;
+static long opsPerRun = 20000;
+static long long trimBytes = 0;
+static long kvKeys = 0;
+static int procs = 1;
+
+static struct int_list engines = { { SKULL_ENGINE_QSET }, 1 };
+static struct int_list quanta = { { 16, 512, 4096 }, 3 };
+static struct int_list qsets = { { 16, 1000 }, 2 };
+static struct int_list ioSizes = { { 16, 512, 4096 }, 3 };
+static struct int_list readPcts = { { 100, 0, 70 }, 3 };
+
+static void parseList(struct int_list* list, char* arg) {
+    char* tok;
+    list->len = 0;
+    for (tok = strtok(arg, ","); tok && list->len < MAX_LIST; tok = strtok(NULL, ",")) {
+        list->values[list->len++] = atoi(tok);
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmpDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double* sorted, long n, double p) {
+    long i = (long)(p * (n - 1));
+    return sorted[i];
+}
+
+/* skull only moves up to the end of a quantum per call, so we loop like a real client */
+static int fullIo(int fd, char* buf, int len, long off, int isRead) {
+    int done = 0;
+    ssize_t n;
+    while (done < len) {
+        if (isRead) {
+            n = pread(fd, buf + done, len - done, off + done);
+        }
+        else {
+            n = pwrite(fd, buf + done, len - done, off + done);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+static const char* engineName(int engine) {
+    if (engine == SKULL_ENGINE_RING) return "ring";
+    return engine == SKULL_ENGINE_EXTENT ? "extent" : "qset";
+}
+
+/* SET_* only changes the values used after the next trim, and opening write only trims */
+static int setGeometry(int engine, int quantum, int qset) {
+    int fd = open(device, O_RDWR);
+    if (fd < 0) return -1;
+    if (ioctl(fd, SKULL_IOC_SET_QUANTUM, &quantum) || ioctl(fd, SKULL_IOC_SET_QSET, &qset) ||
+        ioctl(fd, SKULL_IOC_SET_ENGINE, engine)) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    fd = open(device, O_WRONLY);
+    if (fd < 0) return -1;
+    close(fd);
+    return 0;
+}
+
+static int prefill(int fd, char* buf, int ioSize) {
+    long off;
+    for (off = 0; off < workingSet; off += ioSize) {
+        if (fullIo(fd, buf, ioSize, off, 0) < 0) return -1;
+    }
+    return 0;
+}
+
+static int runOne(struct run* r, char* buf, double* lat) {
+    int fd, isRead, n;
+    long i, slots, off = 0, bytes = 0;
+    double start, t0, elapsed;
+
+    if (setGeometry(r->engine, r->quantum, r->qset)) {
+        perror("setting geometry");
+        return -1;
+    }
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    if (prefill(fd, buf, r->ioSize)) {
+        perror("prefill");
+        close(fd);
+        return -1;
+    }
+    slots = workingSet / r->ioSize;
+    start = now();
+    for (i = 0; i < opsPerRun; i++) {
+        if (r->random) {
+            off = (random() % slots) * r->ioSize;
+        }
+        else if (off + r->ioSize > workingSet) {
+            off = 0;
+        }
+        isRead = (random() % 100) < r->readPct;
+        t0 = now();
+        n = fullIo(fd, buf, r->ioSize, off, isRead);
+        lat[i] = (now() - t0) * 1e6;
+        if (n < 0) {
+            perror("io");
+            close(fd);
+            return -1;
+        }
+        bytes += n;
+        if (!r->random) off += r->ioSize;
+    }
+    elapsed = now() - start;
+    close(fd);
+
+    qsort(lat, opsPerRun, sizeof(double), cmpDouble);
+    printf("%s,%d,%d,%d,%s,%d,%ld,%ld,%.6f,%.2f,%.0f,%.2f,%.2f,%.2f\n",
+        engineName(r->engine), r->quantum, r->qset, r->ioSize, r->random ? "rand" : "seq", r->readPct,
+        opsPerRun, bytes, elapsed, bytes / elapsed / 1e6, opsPerRun / elapsed,
+        percentile(lat, opsPerRun, 0.50), percentile(lat, opsPerRun, 0.99), percentile(lat, opsPerRun, 0.999));
+    fflush(stdout);
+    return 0;
+}
+
+/* fills the device and times the trim that happens when opening it write only */
+static int trimOne(int engine, int quantum, int qset, char* buf, int chunk) {
+    long long off;
+    double start, filled, trimmed;
+    int fd;
+
+    if (setGeometry(engine, quantum, qset)) {
+        perror("setting geometry");
+        return -1;
+    }
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    start = now();
+    for (off = 0; off < trimBytes; off += chunk) {
+        if (fullIo(fd, buf, chunk, off, 0) < 0) {
+            perror("fill");
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    filled = now();
+    fd = open(device, O_WRONLY);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    close(fd);
+    trimmed = now();
+    printf("%s,%d,%d,%lld,%.6f,%.6f\n", engineName(engine), quantum, qset, trimBytes, filled - start, trimmed - filled);
+    fflush(stdout);
+    return 0;
+}
+
+/* a key/value pair the hand rolled way, key i lives at i * valSize */
+static int offsetGetPut(int fd, long i, char* buf, int valSize, int isGet) {
+    return fullIo(fd, buf, valSize, i * valSize, isGet) == valSize ? 0 : -1;
+}
+
+static int kvGetPut(int fd, long i, char* buf, int valSize, int isGet) {
+    char key[32];
+    struct skull_kv kv;
+    kv.keyLen = snprintf(key, sizeof(key), "key%ld", i);
+    kv.key = (unsigned long)key;
+    kv.val = (unsigned long)buf;
+    kv.valLen = valSize;
+    return ioctl(fd, isGet ? SKULL_IOC_KV_GET : SKULL_IOC_KV_PUT, &kv);
+}
+
+/* puts kvKeys keys, then procs processes do opsPerRun random gets each */
+static int kvOne(int useKv, int valSize, char* buf) {
+    int (*op)(int, long, char*, int, int) = useKv ? kvGetPut : offsetGetPut;
+    const char* mode = useKv ? "kv" : "offset";
+    double start, elapsed;
+    long i;
+    int fd, p, status, failed = 0;
+
+    close(open(device, O_WRONLY));
+    fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    start = now();
+    for (i = 0; i < kvKeys; i++) {
+        if (op(fd, i, buf, valSize, 0)) {
+            perror("put");
+            close(fd);
+            return -1;
+        }
+    }
+    elapsed = now() - start;
+    printf("%s,1,%ld,%d,put,%ld,%.6f,%.0f\n", mode, kvKeys, valSize, kvKeys, elapsed, kvKeys / elapsed);
+    fflush(stdout);
+
+    start = now();
+    for (p = 0; p < procs; p++) {
+        if (fork() == 0) {
+            srandom(getpid());
+            for (i = 0; i < opsPerRun; i++) {
+                if (op(fd, random() % kvKeys, buf, valSize, 1)) _exit(1);
+            }
+            _exit(0);
+        }
+    }
+    for (p = 0; p < procs; p++) {
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) failed++;
+    }
+    elapsed = now() - start;
+    close(fd);
+    if (failed) {
+        fprintf(stderr, "%d %s readers failed\n", failed, mode);
+        return -1;
+    }
+    printf("%s,%d,%ld,%d,get,%ld,%.6f,%.0f\n", mode, procs, kvKeys, valSize, opsPerRun * procs, elapsed,
+        opsPerRun * procs / elapsed);
+    fflush(stdout);
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [-d device] [-s working set bytes] [-n ops per run]\n"
+        "          [-q quanta] [-Q qsets] [-i io sizes] [-m read percentages]\n"
+        "          [-T bytes to fill before timing a trim] [-e engines]\n"
+        "          [-K keys to compare the key/value store with offsets] [-P reader processes]\n"
+        "lists are comma separated, e.g. -q 16,4096 -m 100,0,50\n"
+        "engines are %d for quanta and qsets, %d for extents and %d for the ring, e.g. -e %d,%d\n", prog,
+        SKULL_ENGINE_QSET, SKULL_ENGINE_EXTENT, SKULL_ENGINE_RING, SKULL_ENGINE_QSET, SKULL_ENGINE_EXTENT);
+}
+
+int main(int argc, char** argv) {
+    struct run r;
+    char* buf;
+    double* lat;
+    int opt, a, b, c, d, e, g, fd, failed = 0, maxIo = 0;
+
+    while ((opt = getopt(argc, argv, "d:s:n:q:Q:i:m:T:e:K:P:h")) != -1) {
+        switch (opt) {
+        case 'd': device = optarg; break;
+        case 's': workingSet = atol(optarg); break;
+        case 'n': opsPerRun = atol(optarg); break;
+        case 'q': parseList(&quanta, optarg); break;
+        case 'Q': parseList(&qsets, optarg); break;
+        case 'i': parseList(&ioSizes, optarg); break;
+        case 'm': parseList(&readPcts, optarg); break;
+        case 'T': trimBytes = atoll(optarg); break;
+        case 'e': parseList(&engines, optarg); break;
+        case 'K': kvKeys = atol(optarg); break;
+        case 'P': procs = atoi(optarg); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    for (a = 0; a < ioSizes.len; a++) {
+        if (ioSizes.values[a] <= 0 || ioSizes.values[a] > workingSet) {
+            fprintf(stderr, "io size %d does not fit the working set\n", ioSizes.values[a]);
+            return 1;
+        }
+        if (ioSizes.values[a] > maxIo) maxIo = ioSizes.values[a];
+    }
+    if (opsPerRun <= 0 || procs <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    buf = malloc(maxIo);
+    lat = malloc(opsPerRun * sizeof(double));
+    if (!buf || !lat) {
+        perror("malloc");
+        return 1;
+    }
+    memset(buf, 'x', maxIo);
+    srandom(42);
+
+    if (trimBytes > 0) {
+        printf("engine,quantum,qset,bytes,fill_seconds,trim_seconds\n");
+        for (g = 0; g < engines.len; g++)
+            for (a = 0; a < quanta.len; a++)
+                for (b = 0; b < qsets.len; b++)
+                    if (trimOne(engines.values[g], quanta.values[a], qsets.values[b], buf, maxIo)) failed++;
+        goto out;
+    }
+
+    if (kvKeys > 0) {
+        // the io sizes are the value sizes, keys are small either way
+        printf("mode,procs,keys,value_size,phase,ops,seconds,ops_s\n");
+        for (c = 0; c < ioSizes.len; c++) {
+            if (ioSizes.values[c] > SKULL_KV_VALUE_MAX) continue;
+            if (kvOne(0, ioSizes.values[c], buf)) failed++;
+            if (kvOne(1, ioSizes.values[c], buf)) failed++;
+        }
+        goto out;
+    }
+
+    printf("engine,quantum,qset,io_size,pattern,read_pct,ops,bytes,seconds,mb_s,ops_s,p50_us,p99_us,p999_us\n");
+    for (g = 0; g < engines.len; g++)
+        for (a = 0; a < quanta.len; a++)
+            for (b = 0; b < qsets.len; b++)
+                for (c = 0; c < ioSizes.len; c++)
+                    for (d = 0; d < 2; d++)
+                        for (e = 0; e < readPcts.len; e++) {
+                            r.engine = engines.values[g];
+                            r.quantum = quanta.values[a];
+                            r.qset = qsets.values[b];
+                            r.ioSize = ioSizes.values[c];
+                            r.random = d;
+                            r.readPct = readPcts.values[e];
+                            if (runOne(&r, buf, lat)) failed++;
+                        }
+
+out:
+    /* leave the device with the default geometry */
+    fd = open(device, O_RDWR);
+    if (fd >= 0) {
+        ioctl(fd, SKULL_IOC_RESET);
+        close(fd);
+    }
+    free(buf);
+    free(lat);
+    return failed ? 1 : 0;
+}
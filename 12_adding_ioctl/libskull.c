@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "libskull.h"
+
+/* just enough io_uring to send one passthrough command and wait for it, no liburing needed */
+struct skull_ring {
+    int fd;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sqMap;
+    size_t sqLen;
+    void* cqMap;
+    size_t cqLen;
+    size_t sqesLen;
+};
+
+struct skull {
+    int fd;
+    char* path;
+    off_t pos;              /* where the next skull_read or skull_write goes */
+    char* buf;              /* read ahead or staged writes, never both */
+    size_t bufLen;          /* bytes in buf */
+    size_t bufPos;          /* bytes of the read ahead already returned */
+    off_t bufOff;           /* device offset of buf[0] */
+    int dirty;              /* buf holds writes */
+    struct skull_ring ring;
+    int ringState;          /* 0 not tried yet, 1 ready, -1 not available */
+};
+
+static int ringSetup(struct skull_ring* r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, 4, &p);
+    if (r->fd < 0) return -1;
+    r->sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqLen > r->sqLen) r->sqLen = r->cqLen;
+        r->cqLen = 0;
+    }
+    r->sqMap = mmap(NULL, r->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sqMap == MAP_FAILED) goto fail;
+    r->cqMap = r->sqMap;
+    if (r->cqLen) {
+        r->cqMap = mmap(NULL, r->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cqMap == MAP_FAILED) goto unmapSq;
+    }
+    r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto unmapCq;
+    r->sqTail = (unsigned*)((char*)r->sqMap + p.sq_off.tail);
+    r->sqMask = (unsigned*)((char*)r->sqMap + p.sq_off.ring_mask);
+    r->sqArray = (unsigned*)((char*)r->sqMap + p.sq_off.array);
+    r->cqHead = (unsigned*)((char*)r->cqMap + p.cq_off.head);
+    r->cqTail = (unsigned*)((char*)r->cqMap + p.cq_off.tail);
+    r->cqMask = (unsigned*)((char*)r->cqMap + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cqMap + p.cq_off.cqes);
+    return 0;
+
+unmapCq:
+    if (r->cqLen) munmap(r->cqMap, r->cqLen);
+unmapSq:
+    munmap(r->sqMap, r->sqLen);
+fail:
+    close(r->fd);
+    return -1;
+}
+
+static void ringTeardown(struct skull_ring* r) {
+    munmap(r->sqes, r->sqesLen);
+    if (r->cqLen) munmap(r->cqMap, r->cqLen);
+    munmap(r->sqMap, r->sqLen);
+    close(r->fd);
+}
+
+/* sends one passthrough command and returns its cqe result, which may be -errno */
+static int ringCmd(struct skull* s, unsigned int op, void* addr, unsigned int nr) {
+    struct skull_ring* r = &s->ring;
+    struct io_uring_sqe* sqe;
+    struct io_uring_cqe* cqe;
+    struct skull_uring_cmd* cmd;
+    unsigned tail, head, idx;
+    int res;
+
+    tail = *r->sqTail;
+    idx = tail & *r->sqMask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = s->fd;
+    sqe->cmd_op = op;
+    cmd = (struct skull_uring_cmd*)sqe->cmd;
+    cmd->addr = (unsigned long)addr;
+    cmd->nr = nr;
+    r->sqArray[idx] = idx;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, r->fd, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) return -errno;
+    head = *r->cqHead;
+    // batches finish in an io_uring worker, we may be woken before the cqe is there
+    while (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return -errno;
+        }
+    }
+    cqe = &r->cqes[head & *r->cqMask];
+    res = cqe->res;
+    __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+    return res;
+}
+
+/* the ring is set up the first time it's needed, a kernel without it is only asked once */
+static int ringReady(struct skull* s) {
+    struct skull_stats st;
+    if (s->ringState == 0) {
+        s->ringState = -1;
+        if (ringSetup(&s->ring) == 0) {
+            // older kernels and drivers without .uring_cmd fail this one
+            if (ringCmd(s, SKULL_URING_STATS, &st, 0) == 0) {
+                s->ringState = 1;
+            }
+            else {
+                ringTeardown(&s->ring);
+            }
+        }
+    }
+    return s->ringState == 1;
+}
+
+struct skull* skull_open(const char* path, int flags) {
+    struct skull* s = calloc(1, sizeof(struct skull));
+    if (!s) return NULL;
+    s->path = strdup(path);
+    s->buf = malloc(LIBSKULL_BUF_SIZE);
+    if (!s->path || !s->buf) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    s->fd = open(path, flags);
+    if (s->fd < 0) goto fail;
+    return s;
+
+fail:
+    free(s->buf);
+    free(s->path);
+    free(s);
+    return NULL;
+}
+
+int skull_close(struct skull* s) {
+    int err = skull_flush(s);
+    if (s->ringState == 1) ringTeardown(&s->ring);
+    if (close(s->fd) && !err) err = -1;
+    free(s->buf);
+    free(s->path);
+    free(s);
+    return err;
+}
+
+int skull_fd(struct skull* s) {
+    return s->fd;
+}
+
+static ssize_t ringRw(struct skull* s, void* buf, size_t len, off_t off, int op) {
+    struct skull_rw rw = { .off = off, .buf = (unsigned long)buf, .len = len, .op = op };
+    int ran = ringCmd(s, SKULL_URING_RW, &rw, 1);
+    if (ran < 0) {
+        errno = -ran;
+        return -1;
+    }
+    if (rw.result < 0) {
+        errno = -rw.result;
+        return -1;
+    }
+    return rw.result;
+}
+
+/* skull moves at most one quantum per call, so a big transfer takes a loop or a uring command */
+static ssize_t fullIo(struct skull* s, void* buf, size_t len, off_t off, int op) {
+    size_t done = 0;
+    ssize_t n;
+    if (len >= LIBSKULL_RING_MIN && len <= (__u32)-1 && ringReady(s)) {
+        return ringRw(s, buf, len, off, op);
+    }
+    while (done < len) {
+        if (op == SKULL_RW_READ) {
+            n = pread(s->fd, (char*)buf + done, len - done, off + done);
+        }
+        else {
+            n = pwrite(s->fd, (const char*)buf + done, len - done, off + done);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return done ? (ssize_t)done : -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+ssize_t skull_pread_full(struct skull* s, void* buf, size_t len, off_t off) {
+    return fullIo(s, buf, len, off, SKULL_RW_READ);
+}
+
+ssize_t skull_pwrite_full(struct skull* s, const void* buf, size_t len, off_t off) {
+    return fullIo(s, (void*)buf, len, off, SKULL_RW_WRITE);
+}
+
+int skull_flush(struct skull* s) {
+    ssize_t n;
+    if (s->dirty && s->bufLen) {
+        n = skull_pwrite_full(s, s->buf, s->bufLen, s->bufOff);
+        if (n < 0) return -1;
+        if ((size_t)n < s->bufLen) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    s->bufLen = s->bufPos = 0;
+    s->dirty = 0;
+    return 0;
+}
+
+ssize_t skull_read(struct skull* s, void* buf, size_t len) {
+    size_t done = 0, n;
+    ssize_t got;
+    if (s->dirty && skull_flush(s)) return -1;
+    while (done < len) {
+        if (s->bufPos == s->bufLen) {
+            // big reads skip the buffer, there is nothing to gain from copying twice
+            if (len - done >= LIBSKULL_BUF_SIZE) {
+                got = skull_pread_full(s, (char*)buf + done, len - done, s->pos);
+                if (got < 0) return done ? (ssize_t)done : -1;
+                done += got;
+                s->pos += got;
+                break;
+            }
+            got = skull_pread_full(s, s->buf, LIBSKULL_BUF_SIZE, s->pos);
+            if (got < 0) return done ? (ssize_t)done : -1;
+            s->bufOff = s->pos;
+            s->bufLen = got;
+            s->bufPos = 0;
+            if (got == 0) break;
+        }
+        n = s->bufLen - s->bufPos;
+        if (n > len - done) n = len - done;
+        memcpy((char*)buf + done, s->buf + s->bufPos, n);
+        s->bufPos += n;
+        s->pos += n;
+        done += n;
+    }
+    return done;
+}
+
+ssize_t skull_write(struct skull* s, const void* buf, size_t len) {
+    ssize_t n;
+    if (!s->dirty) {
+        // whatever was read ahead is stale once we write
+        s->bufLen = s->bufPos = 0;
+        s->bufOff = s->pos;
+        s->dirty = 1;
+    }
+    if (s->bufLen + len > LIBSKULL_BUF_SIZE) {
+        if (skull_flush(s)) return -1;
+        s->dirty = 1;
+        s->bufOff = s->pos;
+        if (len >= LIBSKULL_BUF_SIZE) {
+            n = skull_pwrite_full(s, buf, len, s->pos);
+            s->dirty = 0;
+            if (n > 0) s->pos += n;
+            return n;
+        }
+    }
+    memcpy(s->buf + s->bufLen, buf, len);
+    s->bufLen += len;
+    s->pos += len;
+    return len;
+}
+
+off_t skull_seek(struct skull* s, off_t off, int whence) {
+    off_t end;
+    if (skull_flush(s)) return -1;
+    switch (whence) {
+    case SEEK_SET: break;
+    case SEEK_CUR: off += s->pos; break;
+    case SEEK_END:
+        end = lseek(s->fd, 0, SEEK_END);
+        if (end < 0) return -1;
+        off += end;
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    if (off < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    s->pos = off;
+    return off;
+}
+
+int skull_batch(struct skull* s, struct skull_rw* rws, unsigned int nr) {
+    unsigned int done = 0, n;
+    ssize_t moved;
+    int ran;
+    if (skull_flush(s)) return -1;
+    if (ringReady(s)) {
+        while (done < nr) {
+            n = nr - done < SKULL_URING_MAX_BATCH ? nr - done : SKULL_URING_MAX_BATCH;
+            ran = ringCmd(s, SKULL_URING_RW, rws + done, n);
+            if (ran < 0) {
+                errno = -ran;
+                return done ? (int)done : -1;
+            }
+            done += ran;
+            if ((unsigned int)ran < n) break;
+        }
+        return done;
+    }
+    for (done = 0; done < nr; done++) {
+        moved = fullIo(s, (void*)(unsigned long)rws[done].buf, rws[done].len, rws[done].off, rws[done].op);
+        rws[done].result = moved < 0 ? -errno : moved;
+    }
+    return done;
+}
+
+int skull_get_geometry(struct skull* s, struct skull_geometry* g) {
+    g->quantum = ioctl(s->fd, SKULL_IOC_QUERY_QUANTUM);
+    g->qset = ioctl(s->fd, SKULL_IOC_QUERY_QSET);
+    g->engine = ioctl(s->fd, SKULL_IOC_QUERY_ENGINE);
+    return g->quantum < 0 || g->qset < 0 || g->engine < 0 ? -1 : 0;
+}
+
+/* needs CAP_SYS_ADMIN and /dev/skull0, private instances say EINVAL. It only reaches the device with a trim */
+int skull_set_geometry(struct skull* s, const struct skull_geometry* g, int trim) {
+    if (ioctl(s->fd, SKULL_IOC_SET_QUANTUM, &g->quantum) || ioctl(s->fd, SKULL_IOC_SET_QSET, &g->qset) ||
+        ioctl(s->fd, SKULL_IOC_SET_ENGINE, g->engine)) {
+        return -1;
+    }
+    return trim ? skull_trim(s) : 0;
+}
+
+/* opening skull write only empties it */
+int skull_trim(struct skull* s) {
+    int fd;
+    s->bufLen = s->bufPos = 0;
+    s->dirty = 0;
+    fd = open(s->path, O_WRONLY);
+    if (fd < 0) return -1;
+    return close(fd);
+}
+
+/* the current geometry comes only through io_uring, without it both are the next one */
+int skull_stats(struct skull* s, struct skull_stats* st) {
+    struct skull_geometry g;
+    off_t end;
+    int res;
+    if (ringReady(s)) {
+        res = ringCmd(s, SKULL_URING_STATS, st, 0);
+        if (res == 0) return 0;
+        errno = -res;
+        return -1;
+    }
+    memset(st, 0, sizeof(*st));
+    end = lseek(s->fd, 0, SEEK_END);
+    if (end < 0 || skull_get_geometry(s, &g)) return -1;
+    st->size = end;
+    st->quantum = st->nextQuantum = g.quantum;
+    st->qset = st->nextQset = g.qset;
+    return 0;
+}
+
+/* one of the files in /sys/kernel/debug/skull, as a string. Needs root */
+ssize_t skull_debugfs(const char* name, char* buf, size_t len) {
+    char path[256];
+    size_t done = 0;
+    ssize_t n;
+    int fd;
+    if (len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/sys/kernel/debug/skull/%s", name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    while (done < len - 1 && (n = read(fd, buf + done, len - 1 - done)) > 0) done += n;
+    buf[done] = '\0';
+    close(fd);
+    return done;
+}
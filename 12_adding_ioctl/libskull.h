@@ -0,0 +1,53 @@
+#ifndef LIBSKULL_H
+#define LIBSKULL_H
+
+#include <sys/types.h>
+#include "test.h"
+
+/*
+ * libskull: the access patterns skull likes, so clients don't each write their own.
+ *
+ * - skull reads and writes stop at the end of a quantum, the *_full calls loop until
+ *   everything moved (or EOF) and retry EINTR
+ * - skull_read and skull_write stream through a buffer from a position of their own
+ * - skull_batch runs many positioned ios with a single io_uring command when the kernel
+ *   has the passthrough (5.19 and newer), and one by one otherwise
+ *
+ * Everything returns -1 and sets errno on failure, like the calls underneath.
+ * A struct skull is not thread safe, open one per thread.
+ */
+
+#define LIBSKULL_BUF_SIZE   (64 << 10)  /* stream buffer, also the size of a read ahead */
+#define LIBSKULL_RING_MIN   (64 << 10)  /* transfers from this size go through one uring command */
+
+struct skull;
+
+/* what the device gets at its next trim, the SET ioctls change it */
+struct skull_geometry {
+    int quantum;
+    int qset;
+    int engine;
+};
+
+struct skull* skull_open(const char* path, int flags);
+int skull_close(struct skull* s);
+int skull_fd(struct skull* s);
+
+ssize_t skull_pread_full(struct skull* s, void* buf, size_t len, off_t off);
+ssize_t skull_pwrite_full(struct skull* s, const void* buf, size_t len, off_t off);
+
+ssize_t skull_read(struct skull* s, void* buf, size_t len);
+ssize_t skull_write(struct skull* s, const void* buf, size_t len);
+off_t skull_seek(struct skull* s, off_t off, int whence);
+int skull_flush(struct skull* s);
+
+int skull_batch(struct skull* s, struct skull_rw* rws, unsigned int nr);
+
+int skull_get_geometry(struct skull* s, struct skull_geometry* g);
+int skull_set_geometry(struct skull* s, const struct skull_geometry* g, int trim);
+int skull_trim(struct skull* s);
+
+int skull_stats(struct skull* s, struct skull_stats* st);
+ssize_t skull_debugfs(const char* name, char* buf, size_t len);
+
+#endif
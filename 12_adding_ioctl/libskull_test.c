@@ -0,0 +1,105 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "libskull.h"
+
+/*
+ * Goes through libskull on a private instance, so nothing else sees what it writes:
+ * small streamed writes read back through the read ahead, a transfer big enough for
+ * the uring command and a batch of positioned ios.
+ */
+
+static char data[1 << 20], back[1 << 20];
+
+/* many small writes are staged and go out in 64K pieces */
+static int streamTest(struct skull* s) {
+    size_t i;
+    for (i = 0; i < sizeof(data); i += 100) {
+        if (skull_write(s, data + i, sizeof(data) - i < 100 ? sizeof(data) - i : 100) < 0) {
+            printf("Oh no!, streamed write failed: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    if (skull_seek(s, 0, SEEK_SET) != 0) {
+        printf("Oh no!, seek failed: %s\n", strerror(errno));
+        return 1;
+    }
+    memset(back, 0, sizeof(back));
+    for (i = 0; i < sizeof(back); i += 333) {
+        if (skull_read(s, back + i, sizeof(back) - i < 333 ? sizeof(back) - i : 333) < 0) {
+            printf("Oh no!, streamed read failed: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    if (memcmp(data, back, sizeof(data))) {
+        printf("Oh no!, the streamed bytes are not what we wrote\n");
+        return 1;
+    }
+    printf("worked! streamed %zu bytes in 100 byte writes\n", sizeof(data));
+    return 0;
+}
+
+/* past LIBSKULL_RING_MIN, so it is a single uring command where the kernel has them */
+static int fullTest(struct skull* s) {
+    off_t off = 8 << 20;
+    memset(back, 0, sizeof(back));
+    if (skull_pwrite_full(s, data, sizeof(data), off) != sizeof(data) ||
+        skull_pread_full(s, back, sizeof(back), off) != sizeof(back) || memcmp(data, back, sizeof(data))) {
+        printf("Oh no!, the full transfer at %lld is not what we wrote\n", (long long)off);
+        return 1;
+    }
+    printf("worked! moved %zu bytes at %lld in one call\n", sizeof(data), (long long)off);
+    return 0;
+}
+
+static int batchTest(struct skull* s) {
+    struct skull_rw rws[16];
+    struct skull_stats st;
+    int i, failed = 0;
+    // eight writes 64K apart, then the eight reads of them
+    for (i = 0; i < 16; i++) {
+        rws[i] = (struct skull_rw){
+            .off = (16 << 20) + (i % 8) * (64 << 10),
+            .buf = (unsigned long)(i < 8 ? data : back) + (i % 8) * 4096,
+            .len = 4096,
+            .op = i < 8 ? SKULL_RW_WRITE : SKULL_RW_READ,
+        };
+    }
+    memset(back, 0, sizeof(back));
+    if (skull_batch(s, rws, 16) != 16) {
+        printf("Oh no!, the batch did not run: %s\n", strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < 16; i++) {
+        if (rws[i].result != 4096) failed++;
+    }
+    if (failed || memcmp(data, back, 8 * 4096)) {
+        printf("Oh no!, %d ios of the batch came back short or wrong\n", failed);
+        return 1;
+    }
+    if (skull_stats(s, &st) || st.size != (16 << 20) + 7 * (64 << 10) + 4096) {
+        printf("Oh no!, the stats don't have the size we wrote\n");
+        return 1;
+    }
+    printf("worked! ran a batch of 16 ios, the device has %llu bytes\n", (unsigned long long)st.size);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* device = argc > 1 ? argv[1] : "/dev/skull1";
+    struct skull* s;
+    size_t i;
+    int failed;
+    for (i = 0; i < sizeof(data); i++) data[i] = 'a' + i % 26 + i / 4096 % 7;
+    s = skull_open(device, O_RDWR);
+    if (!s) {
+        perror(device);
+        return 1;
+    }
+    failed = streamTest(s) + fullTest(s) + batchTest(s);
+    skull_close(s);
+    return failed;
+}
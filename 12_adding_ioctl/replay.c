@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "test.h"
+
+/*
+ * Capture and replay of real traffic on skull, polling_d and async_n.
+ *
+ *     replay -c trace.log [-t seconds] skull polling_d async_n
+ *
+ * drains the capture of every driver named (loaded with capture=N) into one log until
+ * ctrl-c, and
+ *
+ *     replay [-f] trace.log
+ *
+ * runs it again with a thread for every thread that was captured, each doing its own fops in
+ * order at the time they happened, or back to back with -f. It prints the latency of every kind
+ * of fop as captured and as replayed, so two runs of the same log can be compared.
+ * Reads and writes use the captured offsets and lengths, the bytes written are a pattern.
+ */
+
+#define LOG_MAGIC       0x52544b53  /* "SKTR" */
+#define LOG_MAX_DEVS    8
+#define MAX_THREADS     1024
+#define HIST_BUCKETS    40          /* bucket i counts times in [2^(i-1), 2^i) ns */
+#define NR_OPS          4
+
+struct log_header {
+    __u32 magic;
+    __u32 recSize;
+    __u32 nrDevs;
+    __u32 pad;
+    char devs[LOG_MAX_DEVS][16];    /* driver names, a record's dev indexes this */
+};
+
+/* one open file of the replay, found by the device and the file hash of the capture */
+struct open_file {
+    __u32 file;
+    int dev;
+    int fd;
+    int seekable;
+};
+
+struct replayer {
+    pthread_t thread;
+    __u32 pid;
+    unsigned int* recs;
+    unsigned int nr, cap;
+    char* buf;
+    size_t bufLen;
+    long long hist[NR_OPS][HIST_BUCKETS];
+    long long errors, bytes;
+};
+
+static const char* opNames[NR_OPS] = { "open", "read", "write", "release" };
+static struct log_header header;
+static struct skull_trace_rec* recs;
+static size_t nrRecs;
+static struct replayer threads[MAX_THREADS];
+static int nrThreads;
+static struct open_file* files;
+static int nrFiles, capFiles;
+static pthread_mutex_t filesLock = PTHREAD_MUTEX_INITIALIZER;
+static int fast;
+static long long startNs;
+static volatile sig_atomic_t stop;
+static char pattern[SKULL_WC_MAX];
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void histAdd(long long* hist, long long ns) {
+    int i = ns > 0 ? 64 - __builtin_clzll(ns) : 0;
+    hist[i < HIST_BUCKETS ? i : HIST_BUCKETS - 1]++;
+}
+
+// upper bound of the bucket holding the percentile, pct in [0, 100]
+static long long histPercentile(long long* hist, double pct) {
+    long long total = 0, seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) total += hist[i];
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen && seen >= total * pct / 100) return 1LL << i;
+    }
+    return 0;
+}
+
+static void onSignal(int sig) {
+    stop = 1;
+}
+
+static int capture(const char* out, int seconds, char** names, int nr) {
+    struct skull_trace_rec buf[4096];
+    char path[256];
+    int fds[LOG_MAX_DEVS];
+    long long deadline, total = 0;
+    FILE* log;
+    ssize_t n;
+    int i, j, idle, last = 0;
+
+    if (nr > LOG_MAX_DEVS) {
+        fprintf(stderr, "at most %d drivers\n", LOG_MAX_DEVS);
+        return 1;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = LOG_MAGIC;
+    header.recSize = sizeof(struct skull_trace_rec);
+    header.nrDevs = nr;
+    for (i = 0; i < nr; i++) {
+        snprintf(header.devs[i], sizeof(header.devs[i]), "%s", names[i]);
+        snprintf(path, sizeof(path), "/sys/kernel/debug/%s/capture", names[i]);
+        fds[i] = open(path, O_RDONLY);
+        if (fds[i] < 0) {
+            fprintf(stderr, "%s: %s, is %s loaded with capture=N?\n", path, strerror(errno), names[i]);
+            return 1;
+        }
+    }
+    log = fopen(out, "w");
+    if (!log) {
+        perror(out);
+        return 1;
+    }
+    fwrite(&header, sizeof(header), 1, log);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    deadline = seconds > 0 ? nowNs() + seconds * 1000000000LL : 0;
+    // one more pass after the stop, so what came in meanwhile isn't lost
+    while (!last) {
+        last = stop || (deadline && nowNs() >= deadline);
+        idle = 1;
+        for (i = 0; i < nr; i++) {
+            while ((n = read(fds[i], buf, sizeof(buf))) > 0) {
+                for (j = 0; j < n / (ssize_t)sizeof(buf[0]); j++) buf[j].dev = i;
+                fwrite(buf, n, 1, log);
+                total += n / sizeof(buf[0]);
+                idle = 0;
+            }
+            if (n < 0 && errno != EINTR) {
+                perror(header.devs[i]);
+                last = 1;
+            }
+        }
+        if (idle && !last) usleep(10000);
+    }
+    fclose(log);
+    printf("%lld records in %s\n", total, out);
+    for (i = 0; i < nr; i++) {
+        char dropped[32] = "?";
+        snprintf(path, sizeof(path), "/sys/kernel/debug/%s/capture_dropped", names[i]);
+        j = open(path, O_RDONLY);
+        if (j >= 0) {
+            n = read(j, dropped, sizeof(dropped) - 1);
+            dropped[n > 0 ? n - 1 : 0] = '\0';
+            close(j);
+        }
+        printf("%s dropped %s, a bigger capture= keeps more\n", names[i], dropped);
+        close(fds[i]);
+    }
+    return 0;
+}
+
+static int cmpRec(const void* a, const void* b) {
+    const struct skull_trace_rec* x = a;
+    const struct skull_trace_rec* y = b;
+    return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+static int loadLog(const char* in) {
+    FILE* log = fopen(in, "r");
+    size_t cap = 1 << 16;
+    if (!log) {
+        perror(in);
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, log) != 1 || header.magic != LOG_MAGIC ||
+        header.recSize != sizeof(struct skull_trace_rec) || header.nrDevs > LOG_MAX_DEVS) {
+        fprintf(stderr, "%s is not a capture log\n", in);
+        fclose(log);
+        return -1;
+    }
+    recs = malloc(cap * sizeof(*recs));
+    while (recs && fread(&recs[nrRecs], sizeof(*recs), 1, log) == 1) {
+        if (++nrRecs == cap) {
+            cap *= 2;
+            recs = realloc(recs, cap * sizeof(*recs));
+        }
+    }
+    fclose(log);
+    if (!recs) {
+        fprintf(stderr, "no memory for %s\n", in);
+        return -1;
+    }
+    // every driver's records are in order, the mix of them is not
+    qsort(recs, nrRecs, sizeof(*recs), cmpRec);
+    return 0;
+}
+
+// one thread of the replay for every thread of the capture
+static int splitByPid(void) {
+    struct replayer* t;
+    size_t i;
+    int j;
+    for (i = 0; i < nrRecs; i++) {
+        if (recs[i].dev >= header.nrDevs || recs[i].op >= NR_OPS) continue;
+        for (j = 0; j < nrThreads && threads[j].pid != recs[i].pid; j++);
+        if (j == nrThreads) {
+            if (nrThreads == MAX_THREADS) {
+                fprintf(stderr, "more than %d threads in the capture\n", MAX_THREADS);
+                return -1;
+            }
+            threads[nrThreads++].pid = recs[i].pid;
+        }
+        t = &threads[j];
+        if (t->nr == t->cap) {
+            t->cap = t->cap ? t->cap * 2 : 1024;
+            t->recs = realloc(t->recs, t->cap * sizeof(*t->recs));
+            if (!t->recs) return -1;
+        }
+        t->recs[t->nr++] = i;
+    }
+    return 0;
+}
+
+static struct open_file* findFile(const struct skull_trace_rec* rec) {
+    int i;
+    for (i = 0; i < nrFiles; i++) {
+        if (files[i].file == rec->file && files[i].dev == rec->dev) return &files[i];
+    }
+    return NULL;
+}
+
+static int openDevice(const struct skull_trace_rec* rec, int flags) {
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/%s%u", header.devs[rec->dev], rec->minor);
+    return open(path, flags);
+}
+
+// the caller holds filesLock
+static struct open_file* addFile(const struct skull_trace_rec* rec, int fd) {
+    struct open_file* f;
+    if (nrFiles == capFiles) {
+        f = realloc(files, (capFiles ? capFiles * 2 : 64) * sizeof(*files));
+        if (!f) return NULL;
+        files = f;
+        capFiles = capFiles ? capFiles * 2 : 64;
+    }
+    f = &files[nrFiles++];
+    f->file = rec->file;
+    f->dev = rec->dev;
+    f->fd = fd;
+    f->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+    return f;
+}
+
+// files opened before the capture started show up with a read or a write first
+static int fileFor(const struct skull_trace_rec* rec, int* seekable) {
+    struct open_file* f;
+    int fd;
+    pthread_mutex_lock(&filesLock);
+    f = findFile(rec);
+    if (!f) {
+        // not write only, that would trim skull
+        fd = openDevice(rec, O_RDWR);
+        f = fd < 0 ? NULL : addFile(rec, fd);
+        if (!f && fd >= 0) close(fd);
+    }
+    fd = f ? f->fd : -1;
+    *seekable = f ? f->seekable : 0;
+    pthread_mutex_unlock(&filesLock);
+    return fd;
+}
+
+static void closeFile(const struct skull_trace_rec* rec) {
+    struct open_file* f;
+    pthread_mutex_lock(&filesLock);
+    f = findFile(rec);
+    if (f) {
+        close(f->fd);
+        *f = files[--nrFiles];
+    }
+    pthread_mutex_unlock(&filesLock);
+}
+
+static long long replayOne(struct replayer* t, const struct skull_trace_rec* rec) {
+    int fd, seekable;
+    size_t len;
+    ssize_t n = 0;
+    if (rec->op == SKULL_TRACE_OPEN) {
+        // an open that failed back then would leave nothing to replay against
+        if (rec->res < 0) return 0;
+        closeFile(rec);
+        fd = openDevice(rec, rec->len & (O_ACCMODE | O_NONBLOCK | O_APPEND));
+        if (fd < 0) return -1;
+        pthread_mutex_lock(&filesLock);
+        if (!addFile(rec, fd)) {
+            close(fd);
+            fd = -1;
+        }
+        pthread_mutex_unlock(&filesLock);
+        return fd < 0 ? -1 : 0;
+    }
+    if (rec->op == SKULL_TRACE_RELEASE) {
+        closeFile(rec);
+        return 0;
+    }
+    // interrupted fops may have been waiting forever, the ones that said EAGAIN are fine to redo
+    if (rec->res < 0 && rec->res != -EAGAIN) return 0;
+    fd = fileFor(rec, &seekable);
+    if (fd < 0) return -1;
+    if (rec->op == SKULL_TRACE_READ) {
+        if (t->bufLen < rec->len) {
+            free(t->buf);
+            t->buf = malloc(rec->len);
+            t->bufLen = t->buf ? rec->len : 0;
+            if (!t->buf) return -1;
+        }
+        n = seekable ? pread(fd, t->buf, rec->len, rec->off) : read(fd, t->buf, rec->len);
+    }
+    else {
+        // writes longer than the pattern are cut, skull doesn't take more than that at once anyway
+        len = rec->len < sizeof(pattern) ? rec->len : sizeof(pattern);
+        n = seekable ? pwrite(fd, pattern, len, rec->off) : write(fd, pattern, len);
+    }
+    if (n < 0 && errno != EAGAIN) return -1;
+    return n > 0 ? n : 0;
+}
+
+static void* replayThread(void* arg) {
+    struct replayer* t = arg;
+    const struct skull_trace_rec* rec;
+    struct timespec at;
+    long long start, moved, when;
+    unsigned int i;
+    for (i = 0; i < t->nr; i++) {
+        rec = &recs[t->recs[i]];
+        if (!fast) {
+            when = startNs + (long long)(rec->ts - recs[0].ts);
+            at.tv_sec = when / 1000000000LL;
+            at.tv_nsec = when % 1000000000LL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR);
+        }
+        start = nowNs();
+        moved = replayOne(t, rec);
+        histAdd(t->hist[rec->op], nowNs() - start);
+        if (moved < 0) t->errors++;
+        else t->bytes += moved;
+    }
+    return NULL;
+}
+
+static int replay(const char* in) {
+    long long captured[NR_OPS][HIST_BUCKETS], replayed[NR_OPS][HIST_BUCKETS];
+    long long errors = 0, bytes = 0, count, took, span;
+    size_t i;
+    int op, b, j;
+
+    if (loadLog(in) || splitByPid()) return 1;
+    if (!nrRecs) {
+        printf("%s has no records\n", in);
+        return 0;
+    }
+    memset(pattern, 0xa5, sizeof(pattern));
+    memset(captured, 0, sizeof(captured));
+    memset(replayed, 0, sizeof(replayed));
+    for (i = 0; i < nrRecs; i++) {
+        if (recs[i].op < NR_OPS) histAdd(captured[recs[i].op], recs[i].lat);
+    }
+    // everybody starts from the same clock, a little ahead so the last thread is ready too
+    startNs = nowNs() + (fast ? 0 : 10000000LL);
+    for (j = 0; j < nrThreads; j++) {
+        if (pthread_create(&threads[j].thread, NULL, replayThread, &threads[j])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (j = 0; j < nrThreads; j++) {
+        pthread_join(threads[j].thread, NULL);
+        for (op = 0; op < NR_OPS; op++) {
+            for (b = 0; b < HIST_BUCKETS; b++) replayed[op][b] += threads[j].hist[op][b];
+        }
+        errors += threads[j].errors;
+        bytes += threads[j].bytes;
+    }
+    took = nowNs() - startNs;
+    span = recs[nrRecs - 1].ts - recs[0].ts;
+    printf("%zu fops from %d threads, captured over %.3fs, replayed in %.3fs, %lld bytes, %lld errors\n",
+        nrRecs, nrThreads, span / 1e9, took / 1e9, bytes, errors);
+    printf("%-8s %10s %14s %14s %14s %14s\n", "fop", "count", "captured_p50", "captured_p99", "replay_p50", "replay_p99");
+    for (op = 0; op < NR_OPS; op++) {
+        for (count = 0, b = 0; b < HIST_BUCKETS; b++) count += captured[op][b];
+        if (!count) continue;
+        printf("%-8s %10lld %14lld %14lld %14lld %14lld\n", opNames[op], count,
+            histPercentile(captured[op], 50), histPercentile(captured[op], 99),
+            histPercentile(replayed[op], 50), histPercentile(replayed[op], 99));
+    }
+    return errors ? 2 : 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s -c log [-t seconds] driver...   capture, until ctrl-c or the time is up\n"
+        "       %s [-f] log                         replay, -f for as fast as possible\n",
+        prog, prog);
+}
+
+int main(int argc, char** argv) {
+    const char* out = NULL;
+    int seconds = 0, opt;
+    while ((opt = getopt(argc, argv, "c:t:fh")) != -1) {
+        switch (opt) {
+        case 'c': out = optarg; break;
+        case 't': seconds = atoi(optarg); break;
+        case 'f': fast = 1; break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (out) {
+        if (optind == argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        return capture(out, seconds, argv + optind, argc - optind);
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    return replay(argv[optind]);
+}
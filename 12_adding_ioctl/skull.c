@@ -10,225 +10,1959 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/uaccess.h> /* copy_from_user, copy_to_user */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/moduleparam.h>
+#include <linux/version.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/jhash.h>
+#include <linux/crc32c.h>
+#include <linux/rcupdate.h>
+#include <linux/mempool.h>
+#include <linux/delay.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0) /* the block frontend */
+#include <linux/blk-mq.h>
+#include <linux/blkdev.h>
+#include <linux/highmem.h>
+#include <linux/sched/mm.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#endif
 #include <asm/current.h>
 #include <linux/errno.h> /* EFAULT */
 #include "skull.h"
 
 static int devNum;
 static int min = 0;
-static int count = 1;
+static int count = 2; /* minor 0 is the shared device, minor 1 gives every open its own */
 const char* PREF = "[ skull ]";
 int qset_size = Q_SET_SIZE;
 int  quantum_size = QUANTUM_SIZE;
+static int engine = SKULL_ENGINE_QSET;
+module_param(engine, int, 0444);
+MODULE_PARM_DESC(engine, "default storage engine, 0 for quanta and qsets, 1 for extents, 2 for the ring");
+int engine_kind = SKULL_ENGINE_QSET; /* engine used after the next trim */
+static int ring_size = 1 << 20;
+module_param(ring_size, int, 0444);
+MODULE_PARM_DESC(ring_size, "bytes kept by the ring engine (default 1MB)");
 
+static struct cdev privCdev;
 static struct skull_d skull = { .data = NULL, .qset = Q_SET_SIZE, .quantum = QUANTUM_SIZE, .size = 0 };
+static struct dentry* debugDir;
+static const char* fopNames[SKULL_FOP_NR] = { "open", "read", "write", "ioctl", "poll", "release" };
+#define STATS_FOP_NR SKULL_FOP_NR
+#include "../common/lock_stats.h"
+#include "../common/fop_latency.h"
+#include "../common/fop_capture.h"
 
-static struct node* getNodeByIndex(struct skull_d* dev, int index) {
+static int lock_dev_nested(struct skull_d* dev, int fop, u64* lockedAt, bool interruptible, unsigned int subclass) {
+    // nobody else can see a private instance, we skip the stats so not even those are shared.
+    // the block disk skips them too, its lock is not skull0's
+    if (dev->priv || dev->blk) {
+        *lockedAt = 0;
+        if (!interruptible) {
+            mutex_lock_nested(&dev->lock, subclass);
+            return 0;
+        }
+        return mutex_lock_interruptible_nested(&dev->lock, subclass) ? -ERESTARTSYS : 0;
+    }
+    return stats_lock(&dev->lock, fop, lockedAt, interruptible, subclass);
+}
+
+static int lock_dev(struct skull_d* dev, int fop, u64* lockedAt, bool interruptible) {
+    return lock_dev_nested(dev, fop, lockedAt, interruptible, 0);
+}
+
+static void unlock_dev(struct skull_d* dev, int fop, u64 lockedAt) {
+    stats_unlock(&dev->lock, fop, lockedAt);
+}
+
+/*
+ * Objects allocated before taking the lock, so the data path never allocates while
+ * holding it. When a lookup is missing something it records it here, we drop the lock,
+ * allocate and try again. Whatever is left over is freed after unlocking.
+ */
+struct prealloc {
+    struct node* nodes;         /* spare nodes, chained through next */
+    struct quantum** array;
+    int arrayLen;
+    struct quantum* q;
+    int qSize;
+    struct quantum* small;      /* inline storage for a device that has nothing yet */
+    struct skull_extent* ext;   /* for the extent engine */
+    struct quantum* extQ;
+    size_t extCap;              /* capacity asked for extQ */
+    size_t want;                /* how many bytes the caller is about to write */
+    int needNodes;
+    bool needArray, needQuantum, needSmall, needExtent;
+    bool busy;                  /* the inline data is pinned, wait a bit and retry */
+};
+
+static int inline_max = 256;
+module_param(inline_max, int, 0444);
+MODULE_PARM_DESC(inline_max, "devices smaller than this keep their data in a single allocation (default 256, 0 disables)");
+
+/*
+ * Reserve for when memory is tight: we first try a cheap allocation that gives up instead
+ * of reclaiming hard, and only then dip into the mempool. Each pool serves one size, the
+ * one given by the geometry at load time, other geometries are counted apart and fall
+ * back to a regular allocation. Freed objects of the right size top the pool up again.
+ */
+struct reserve {
+    const char* name;
+    struct kmem_cache* cache;   /* where the objects come from, kmalloc when NULL */
+    mempool_t* pool;
+    size_t size;
+    atomic64_t hits;    /* allocations that only succeeded thanks to the reserve */
+    atomic64_t misses;  /* allocations of its size that needed it and found it empty */
+    atomic64_t other;   /* allocations that needed it but were of another size, after a SET_QUANTUM */
+};
+
+static int reserve_nr = 64;
+module_param(reserve_nr, int, 0444);
+MODULE_PARM_DESC(reserve_nr, "nodes, qset arrays and quanta kept aside for writes under memory pressure (default 64, 0 disables)");
+static struct reserve nodeReserve = { .name = "node" };
+static struct reserve arrayReserve = { .name = "qset" };
+static struct reserve headerReserve = { .name = "header" };
+static struct reserve quantumReserve = { .name = "quantum" };
+static struct reserve blkReserve = { .name = "blk" };   /* quanta of the block disk, when there is one */
+static struct reserve* reserves[] = { &nodeReserve, &arrayReserve, &headerReserve, &quantumReserve, &blkReserve };
+
+static int reserve_init(struct reserve* r, size_t size) {
+    r->size = size;
+    if (reserve_nr <= 0) return 0;
+    if (r->cache) r->pool = mempool_create_slab_pool(reserve_nr, r->cache);
+    else r->pool = mempool_create_kmalloc_pool(reserve_nr, size);
+    return r->pool ? 0 : -ENOMEM;
+}
+
+static void* reserve_zalloc(struct reserve* r, size_t size, gfp_t gfp) {
+    return r->cache ? kmem_cache_zalloc(r->cache, gfp) : kzalloc(size, gfp);
+}
+
+static void reserve_destroy(struct reserve* r) {
+    mempool_destroy(r->pool);
+    r->pool = NULL;
+}
+
+static void* reserve_alloc(struct reserve* r, size_t size) {
+    void* p = reserve_zalloc(r, size, GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+    int before;
+    if (p) return p;
+    if (r->pool && size == r->size) {
+        // mempool tries the allocator once more before the pool, only a smaller pool is a hit.
+        // a refill racing with us can hide one, these are statistics
+        before = READ_ONCE(r->pool->curr_nr);
+        p = mempool_alloc(r->pool, GFP_NOWAIT | __GFP_NOWARN);
+        if (p) {
+            if (READ_ONCE(r->pool->curr_nr) < before) atomic64_inc(&r->hits);
+            // pool elements come back dirty, and so does what mempool's kmalloc gives
+            memset(p, 0, size);
+            return p;
+        }
+        atomic64_inc(&r->misses);
+    }
+    else if (r->pool) {
+        atomic64_inc(&r->other);
+    }
+    // no luck, same as before the reserve existed
+    return reserve_zalloc(r, size, GFP_KERNEL);
+}
+
+// gives the object to the pool if it's running low, otherwise the caller frees it
+static bool reserve_refill(struct reserve* r, void* p, size_t size) {
+    if (!p || !r->pool || size != r->size || is_vmalloc_addr(p) ||
+        READ_ONCE(r->pool->curr_nr) >= r->pool->min_nr) {
+        return false;
+    }
+    mempool_free(p, r->pool);
+    return true;
+}
+
+static void reserve_free(struct reserve* r, void* p, size_t size) {
+    if (reserve_refill(r, p, size)) return;
+    if (r->cache) {
+        kmem_cache_free(r->cache, p);
+    }
+    else {
+        // extents can be vmalloc'ed
+        kvfree(p);
+    }
+}
+
+/*
+ * Integrity checksums. With checksum=1 every quantum carries a struct quantum_crc
+ * right after its header, with the crc32c (the accelerated one the cpu has) of all its bytes.
+ * Every copy into a quantum is bracketed by quantum_write_begin/end and the sum is
+ * redone at the end. Copies run without the lock and may overlap, so each finished copy
+ * takes a sequence number and only a newer sum replaces an older one. The verifier
+ * skips quanta with a copy in flight, their sum is about to change anyway.
+ */
+struct quantum_crc {
+    atomic_t writers;       /* copies into the quantum in flight */
+    atomic_t seq;           /* copies finished */
+    atomic64_t state;       /* seq << 32 | crc32c after copy seq, 0 until the first one ends */
+};
+
+static bool checksum;
+module_param(checksum, bool, 0444);
+MODULE_PARM_DESC(checksum, "keep a crc32c of every quantum, checked with SKULL_IOC_VERIFY (default off)");
+
+static struct kmem_cache* quantumCache; /* the headers, with their checksum when there is one */
+
+static size_t quantum_header_bytes(void) {
+    return sizeof(struct quantum) + (checksum ? sizeof(struct quantum_crc) : 0);
+}
+
+// what a quantum really takes, slab rounding included
+static size_t quantum_memory(struct quantum* q) {
+    size_t data = is_vmalloc_addr(q->data) ? PAGE_ALIGN(q->size) : ksize(q->data);
+    return quantum_header_bytes() + data;
+}
+
+static struct quantum_crc* quantum_crc(struct quantum* q) {
+    return (struct quantum_crc*)(q + 1);
+}
+
+static void quantum_write_begin(struct quantum* q) {
+    if (!checksum) return;
+    atomic_inc(&quantum_crc(q)->writers);
+    // the verifier must not see our bytes without seeing us, pairs with its smp_rmb
+    smp_mb__after_atomic();
+}
+
+static void quantum_write_end(struct quantum* q) {
+    struct quantum_crc* c;
+    s64 old, new;
+    u32 seq;
+
+    if (!checksum) return;
+    c = quantum_crc(q);
+    seq = atomic_inc_return(&c->seq);
+    new = (s64)seq << 32 | crc32c(~0, q->data, q->size);
+    // a copy that finished before us but sums slower must not put back an older sum
+    old = atomic64_read(&c->state);
+    do {
+        if ((s32)((u32)(old >> 32) - seq) >= 0) break;
+    } while (!atomic64_try_cmpxchg(&c->state, &old, new));
+    smp_mb__before_atomic();
+    atomic_dec(&c->writers);
+}
+
+// 0 when the data matches its sum, 1 when it doesn't, -EBUSY when it can't be told now
+static int quantum_verify(struct quantum* q) {
+    struct quantum_crc* c = quantum_crc(q);
+    s64 state;
+    u32 seq, crc;
+
+    if (atomic_read(&c->writers)) return -EBUSY;
+    smp_rmb();
+    seq = atomic_read(&c->seq);
+    state = atomic64_read(&c->state);
+    if (!state || (u32)(state >> 32) != seq) return -EBUSY;
+    crc = crc32c(~0, q->data, q->size);
+    smp_rmb();
+    // somebody started writing while we summed, the mismatch could be theirs
+    if (atomic_read(&c->writers) || atomic_read(&c->seq) != seq) return -EBUSY;
+    return crc != (u32)state;
+}
+
+// takes the data, which is freed with the header from now on
+// the block disk has quanta of its own size, and its writeback needs a pool of them most
+static struct reserve* data_reserve(size_t size) {
+    return blkReserve.pool && size == blkReserve.size ? &blkReserve : &quantumReserve;
+}
+
+static struct quantum* quantum_wrap(char* data, size_t size) {
+    struct quantum* q;
+    if (!data) return NULL;
+    q = reserve_alloc(&headerReserve, headerReserve.size);
+    if (!q) {
+        reserve_free(data_reserve(size), data, size);
+        return NULL;
+    }
+    refcount_set(&q->ref, 1);
+    atomic_set(&q->owners, 1);
+    q->size = size;
+    q->data = data;
+    return q;
+}
+
+static struct quantum* quantum_alloc(int size) {
+    // zeroed, so a reader racing with the first write never sees stale memory
+    return quantum_wrap(reserve_alloc(data_reserve(size), size), size);
+}
+
+static void quantum_free(struct quantum* q) {
+    reserve_free(data_reserve(q->size), q->data, q->size);
+    reserve_free(&headerReserve, q, headerReserve.size);
+}
+
+static void quantum_put(struct quantum* q) {
+    if (q && refcount_dec_and_test(&q->ref)) {
+        quantum_free(q);
+    }
+}
+
+// the data of an extent, one allocation no matter how big so it may come from vmalloc
+static struct quantum* extent_data_alloc(size_t size) {
+    return quantum_wrap(kvzalloc(size, GFP_KERNEL), size);
+}
+
+static int prealloc_fill(struct prealloc* pre, int quantum, int qset) {
+    struct node* n;
+
+    while (pre->needNodes > 0) {
+        n = reserve_alloc(&nodeReserve, sizeof(struct node));
+        if (!n) return -ENOMEM;
+        n->next = pre->nodes;
+        pre->nodes = n;
+        pre->needNodes--;
+    }
+    // the geometry may change under us with a trim, so sizes are checked again when used
+    if (pre->needArray && (!pre->array || pre->arrayLen != qset)) {
+        reserve_free(&arrayReserve, pre->array, pre->arrayLen * sizeof(struct quantum*));
+        pre->array = reserve_alloc(&arrayReserve, qset * sizeof(struct quantum*));
+        if (!pre->array) return -ENOMEM;
+        pre->arrayLen = qset;
+    }
+    if (pre->needQuantum && (!pre->q || pre->qSize != quantum)) {
+        quantum_put(pre->q);
+        pre->q = quantum_alloc(quantum);
+        if (!pre->q) return -ENOMEM;
+        pre->qSize = quantum;
+    }
+    if (pre->needSmall && !pre->small) {
+        pre->small = quantum_alloc(inline_max);
+        if (!pre->small) return -ENOMEM;
+    }
+    if (pre->needExtent) {
+        if (!pre->ext) {
+            pre->ext = kzalloc(sizeof(struct skull_extent), GFP_KERNEL);
+            if (!pre->ext) return -ENOMEM;
+        }
+        if (!pre->extQ || pre->extQ->size < pre->extCap) {
+            quantum_put(pre->extQ);
+            pre->extQ = extent_data_alloc(pre->extCap);
+            if (!pre->extQ) return -ENOMEM;
+        }
+    }
+    if (pre->busy) {
+        // whoever pinned it is in the middle of a copy, that won't take long
+        usleep_range(10, 100);
+    }
+    pre->needArray = false;
+    pre->needQuantum = false;
+    pre->needSmall = false;
+    pre->needExtent = false;
+    pre->busy = false;
+    return 0;
+}
+
+static void prealloc_release(struct prealloc* pre) {
+    struct node* n;
+    while (pre->nodes) {
+        n = pre->nodes;
+        pre->nodes = n->next;
+        reserve_free(&nodeReserve, n, sizeof(struct node));
+    }
+    reserve_free(&arrayReserve, pre->array, pre->arrayLen * sizeof(struct quantum*));
+    quantum_put(pre->q);
+    quantum_put(pre->small);
+    kfree(pre->ext);
+    quantum_put(pre->extQ);
+}
+
+static struct node* prealloc_node(struct prealloc* pre) {
+    struct node* n = pre->nodes;
+    pre->nodes = n->next;
+    n->next = NULL;
+    return n;
+}
+
+#define PREALLOC_NODES 64 /* nodes linked per lock round, so a far away sparse write can't hog the lock */
+
+/*
+ * Walks to the node at index, with a NULL pre missing nodes are not created.
+ * The cursor is left on the furthest node we reached even when we fail, so the retry
+ * after allocating more nodes continues from there.
+ */
+static struct node* getNodeByIndex(struct skull_d* dev, struct skull_cursor* cursor, u64 index, struct prealloc* pre) {
     struct node* targetNode = dev->data;
+    u64 at = 0;
+
+    // if the cursor is still valid and behind us, we can start walking from it
+    if (cursor && cursor->node && cursor->generation == dev->generation && cursor->index <= index) {
+        targetNode = cursor->node;
+        at = cursor->index;
+    }
     if (!targetNode) {
-        targetNode = dev->data = kmalloc(sizeof(struct node), GFP_KERNEL);
-        if (targetNode == NULL) return NULL;
-        memset(targetNode, 0, sizeof(struct node));
+        if (!pre || !pre->nodes) {
+            if (pre) pre->needNodes = min_t(u64, index + 1, PREALLOC_NODES);
+            return NULL;
+        }
+        targetNode = dev->data = prealloc_node(pre);
     }
 
-    while (index--) {
+    while (at < index) {
         if (!targetNode->next) {
-            targetNode->next = kmalloc(sizeof(struct node), GFP_KERNEL);
-            if (targetNode->next == NULL) return NULL;
-            memset(targetNode->next, 0, sizeof(struct node));
+            if (!pre || !pre->nodes) {
+                if (pre) pre->needNodes = min_t(u64, index - at, PREALLOC_NODES);
+                break;
+            }
+            targetNode->next = prealloc_node(pre);
         }
         targetNode = targetNode->next;
-        continue;
+        at++;
+    }
+    if (cursor) {
+        cursor->node = targetNode;
+        cursor->index = at;
+        cursor->generation = dev->generation;
     }
-    return targetNode;
+    return at == index ? targetNode : NULL;
 }
 
-int skull_trim(struct skull_d* dev) {
+// the slot in the node list holding off, creates the node and array from pre but not the quantum
+static struct quantum** slotAt(struct skull_d* dev, struct skull_cursor* cursor, loff_t off,
+    size_t* qOff, size_t* avail, struct prealloc* pre) {
+    struct node* targetNode;
+    int quantum, qset;
+    u64 pageSize, nodeIndex, rest;
+    u32 s_pos, q_pos;
+
+    quantum = dev->quantum;
+    qset = dev->qset;
+    if (dev->pageShift >= 0) {
+        // power of two geometry, no divisions at all
+        nodeIndex = (u64)off >> dev->pageShift;
+        s_pos = (off & (((u64)1 << dev->pageShift) - 1)) >> dev->qShift;
+        q_pos = off & (quantum - 1);
+    }
+    else {
+        // everything in 64 bits, a sparse device can live way past 4GB
+        pageSize = (u64)quantum * qset;
+        nodeIndex = div64_u64_rem(off, pageSize, &rest);
+        s_pos = div_u64_rem(rest, quantum, &q_pos);
+    }
+    *qOff = q_pos;
+    *avail = quantum - q_pos;
+
+    targetNode = getNodeByIndex(dev, cursor, nodeIndex, pre);
+    if (targetNode == NULL) {
+        // a new node comes empty, ask for everything at once to retry only once
+        if (pre) pre->needArray = pre->needQuantum = true;
+        return NULL;
+    }
+    if (!targetNode->data) {
+        if (!pre) return NULL;
+        if (!pre->array || pre->arrayLen != qset) {
+            pre->needArray = pre->needQuantum = true;
+            return NULL;
+        }
+        targetNode->data = pre->array;
+        pre->array = NULL;
+    }
+    return &targetNode->data[s_pos];
+}
+
+// drops one slot's hold on a quantum
+static void slot_put(struct quantum* q) {
+    if (q) {
+        atomic_dec(&q->owners);
+        quantum_put(q);
+    }
+}
+
+/*
+ * Same as quantumAt but only looks at the node list.
+ * Writers (pre != NULL) never get a quantum shared with a clone, they get a private copy.
+ */
+static struct quantum* treeQuantumAt(struct skull_d* dev, struct skull_cursor* cursor, loff_t off,
+    size_t* qOff, size_t* avail, struct prealloc* pre) {
+    struct quantum** slot;
+    struct quantum* old;
+
+    slot = slotAt(dev, cursor, off, qOff, avail, pre);
+    if (!slot) return NULL;
+    if (!pre) return *slot;
+    if (!*slot || atomic_read(&(*slot)->owners) > 1) {
+        if (!pre->q || pre->qSize != dev->quantum) {
+            pre->needQuantum = true;
+            return NULL;
+        }
+        old = *slot;
+        *slot = pre->q;
+        pre->q = NULL;
+        if (old) {
+            quantum_write_begin(*slot);
+            memcpy((*slot)->data, old->data, dev->quantum);
+            quantum_write_end(*slot);
+            slot_put(old);
+        }
+    }
+    return *slot;
+}
+
+/*
+ * Moves the inline data of a device that outgrew it into the node list, returns 0 once done.
+ * The whole range is allocated before copying anything, so running out of pre halfway
+ * leaves the inline data in charge and we just continue on the next round.
+ */
+static int inline_migrate(struct skull_d* dev, struct skull_cursor* cursor, struct prealloc* pre) {
+    struct quantum* small = dev->small;
+    struct quantum* q;
+    size_t qOff, avail;
+    loff_t pos;
+
+    // somebody is still copying to or from it, moving it now could lose their bytes
+    if (refcount_read(&small->ref) > 1) {
+        pre->busy = true;
+        return -EBUSY;
+    }
+    for (pos = 0; pos < small->size; pos += avail) {
+        if (!treeQuantumAt(dev, cursor, pos, &qOff, &avail, pre)) return -ENOMEM;
+    }
+    for (pos = 0; pos < small->size; pos += avail) {
+        q = treeQuantumAt(dev, cursor, pos, &qOff, &avail, NULL);
+        avail = min_t(size_t, avail, small->size - pos);
+        quantum_write_begin(q);
+        memcpy(q->data + qOff, small->data + pos, avail);
+        quantum_write_end(q);
+    }
+    dev->small = NULL;
+    quantum_put(small);
+    return 0;
+}
+
+#define EXTENT_MIN 4096                 /* smallest extent, tiny writes leave room to grow */
+#define EXTENT_MERGE_MAX (256 << 10)    /* biggest extent we copy under the lock to grow it */
+#define EXTENT_MAX (16 << 20)           /* biggest single allocation */
+
+// the extent with the biggest start <= off, or NULL
+static struct skull_extent* extent_floor(struct rb_root* root, loff_t off) {
+    struct rb_node* n = root->rb_node;
+    struct skull_extent* best = NULL;
+    struct skull_extent* e;
+    while (n) {
+        e = rb_entry(n, struct skull_extent, rb);
+        if (e->start <= off) {
+            best = e;
+            n = n->rb_right;
+        }
+        else {
+            n = n->rb_left;
+        }
+    }
+    return best;
+}
+
+static void extent_insert(struct rb_root* root, struct skull_extent* new) {
+    struct rb_node** link = &root->rb_node;
+    struct rb_node* parent = NULL;
+    struct skull_extent* e;
+    while (*link) {
+        parent = *link;
+        e = rb_entry(parent, struct skull_extent, rb);
+        link = new->start < e->start ? &parent->rb_left : &parent->rb_right;
+    }
+    rb_link_node(&new->rb, parent, link);
+    rb_insert_color(&new->rb, root);
+}
+
+/*
+ * quantumAt for the extent engine. Extents never overlap: a new one only fills the gap
+ * up to the next, and appending right after an extent grows it in place while it has
+ * room. Small full extents are copied into a bigger one (merging what would otherwise
+ * be a chain of tiny neighbours), big ones just get a new neighbour twice their size.
+ */
+static struct quantum* extentAt(struct skull_d* dev, loff_t off, size_t* qOff, size_t* avail,
+    struct prealloc* pre) {
+    struct skull_extent* e = extent_floor(&dev->extents, off);
+    struct rb_node* next = e ? rb_next(&e->rb) : rb_first(&dev->extents);
+    struct skull_extent* new;
+    size_t want, cap, n;
+    u64 gap;
+
+    if (e && off < e->start + e->len) {
+        *qOff = off - e->start;
+        *avail = e->len - *qOff;
+        return e->q;
+    }
+    gap = next ? rb_entry(next, struct skull_extent, rb)->start - off : EXTENT_MAX;
+    *qOff = 0;
+    *avail = min_t(u64, gap, EXTENT_MAX);
+    if (!pre) return NULL;
+    want = clamp_t(size_t, pre->want, 1, *avail);
+
+    if (e && off == e->start + e->len) {
+        if (e->len == e->q->size && e->len <= EXTENT_MERGE_MAX && refcount_read(&e->q->ref) == 1) {
+            cap = min_t(size_t, max(e->len * 2, e->len + want), EXTENT_MAX);
+            if (!pre->extQ || pre->extQ->size <= e->len) {
+                pre->needExtent = true;
+                pre->extCap = cap;
+                return NULL;
+            }
+            quantum_write_begin(pre->extQ);
+            memcpy(pre->extQ->data, e->q->data, e->len);
+            quantum_write_end(pre->extQ);
+            quantum_put(e->q);
+            e->q = pre->extQ;
+            pre->extQ = NULL;
+        }
+        if (e->len < e->q->size) {
+            n = min(want, e->q->size - e->len);
+            *qOff = e->len;
+            *avail = n;
+            e->len += n;
+            return e->q;
+        }
+    }
+
+    // a new extent, as big as the write, or twice the one we are appending to
+    cap = want;
+    if (e && off == e->start + e->len) {
+        cap = max_t(size_t, cap, e->q->size * 2);
+    }
+    cap = min_t(u64, clamp_t(size_t, cap, EXTENT_MIN, EXTENT_MAX), gap);
+    if (!pre->ext || !pre->extQ || pre->extQ->size < want) {
+        pre->needExtent = true;
+        pre->extCap = cap;
+        return NULL;
+    }
+    new = pre->ext;
+    pre->ext = NULL;
+    new->start = off;
+    new->len = want;
+    new->q = pre->extQ;
+    pre->extQ = NULL;
+    extent_insert(&dev->extents, new);
+    *avail = want;
+    return new->q;
+}
+
+/*
+ * Finds the quantum holding off, must hold dev->lock.
+ * qOff is where off lands inside it and avail how many bytes are left until its end,
+ * both are set even when the quantum does not exist, so readers can zero fill holes.
+ * With a NULL pre this is a plain lookup, otherwise missing pieces are taken from pre,
+ * and when pre does not have them we return NULL and pre says what to allocate.
+ * Tiny devices answer from their inline quantum, writing past it moves them to the list.
+ */
+static struct quantum* quantumAt(struct skull_d* dev, struct skull_cursor* cursor, loff_t off,
+    size_t* qOff, size_t* avail, struct prealloc* pre) {
+    if (dev->engine == SKULL_ENGINE_EXTENT) {
+        return extentAt(dev, off, qOff, avail, pre);
+    }
+    if (dev->small) {
+        if (off < dev->small->size) {
+            *qOff = off;
+            *avail = dev->small->size - off;
+            return dev->small;
+        }
+        if (pre && inline_migrate(dev, cursor, pre)) {
+            return NULL;
+        }
+    }
+    else if (!dev->data && off < inline_max && !dev->blk) {
+        *qOff = off;
+        *avail = inline_max - off;
+        if (!pre) return NULL;
+        if (!pre->small) {
+            pre->needSmall = true;
+            return NULL;
+        }
+        dev->small = pre->small;
+        pre->small = NULL;
+        return dev->small;
+    }
+    return treeQuantumAt(dev, cursor, off, qOff, avail, pre);
+}
+
+#define TRIM_BATCH 32 /* pointers handed to kfree_bulk at once */
+
+struct trim_batch {
+    void* ptrs[TRIM_BATCH];
+    size_t len;
+};
+
+static void trim_batch_add(struct trim_batch* batch, void* ptr) {
+    if (!ptr) return;
+    batch->ptrs[batch->len++] = ptr;
+    if (batch->len == TRIM_BATCH) {
+        kfree_bulk(batch->len, batch->ptrs);
+        batch->len = 0;
+        // a big device has millions of quanta, let others run between chunks
+        cond_resched();
+    }
+}
+
+// frees a whole list of nodes, it does not need the device anymore
+static void free_nodes(struct node* first, int qset) {
+    struct trim_batch batch = { .len = 0 };
     struct node* currentNode;
     struct node* nextNode;
-    int qset = dev->qset;
+    struct quantum* q;
     int i;
 
-    for (currentNode = dev->data; currentNode; currentNode = nextNode) {
+    for (currentNode = first; currentNode; currentNode = nextNode) {
         if (currentNode->data) {
             for (i = 0; i < qset; i++) {
-                kfree(currentNode->data[i]);
+                q = currentNode->data[i];
+                if (q) atomic_dec(&q->owners);
+                // quanta still pinned by a copy in flight or shared with a clone are freed by their last user
+                if (q && refcount_dec_and_test(&q->ref)) {
+                    if (!reserve_refill(data_reserve(q->size), q->data, q->size)) {
+                        trim_batch_add(&batch, q->data);
+                    }
+                    reserve_free(&headerReserve, q, headerReserve.size);
+                }
+            }
+            if (!reserve_refill(&arrayReserve, currentNode->data, qset * sizeof(struct quantum*))) {
+                trim_batch_add(&batch, currentNode->data);
             }
-            kfree(currentNode->data);
-            currentNode->data = NULL;
         }
         nextNode = currentNode->next;
-        kfree(currentNode);
+        if (!reserve_refill(&nodeReserve, currentNode, sizeof(struct node))) {
+            trim_batch_add(&batch, currentNode);
+        }
     }
-    dev->size = 0;
-    dev->qset = qset_size;
-    dev->quantum = quantum_size;
+    if (batch.len) {
+        kfree_bulk(batch.len, batch.ptrs);
+    }
+}
+
+// followers sleep at the end of the device until a write lands past them or a trim
+static void wake_followers(struct skull_d* dev) {
+    if (wq_has_sleeper(&dev->readq)) {
+        wake_up_interruptible(&dev->readq);
+    }
+}
+
+static void free_extents(struct rb_root* root) {
+    struct skull_extent* e;
+    struct skull_extent* n;
+    int freed = 0;
+    rbtree_postorder_for_each_entry_safe(e, n, root, rb) {
+        quantum_put(e->q);
+        kfree(e);
+        if (++freed % TRIM_BATCH == 0) cond_resched();
+    }
+    *root = RB_ROOT;
+}
+
+/*
+ * Key/value store. Entries live in an rhashtable, which resizes by itself and locks
+ * per bucket, so writers to different keys don't meet and lookups take no lock at all.
+ * Values are quanta of exactly their size. Entries are never changed in place, a put
+ * swaps in a new one and the old one goes after an RCU grace period, so a reader that
+ * found it can still take a reference to its value.
+ */
+static u32 kv_hash(const void* data, u32 len, u32 seed) {
+    const struct kv_key* key = data;
+    // the padding is all zeros, hashing only the used bytes is enough
+    return jhash(key->data, key->len, seed);
+}
+
+static const struct rhashtable_params kvParams = {
+    .key_len = sizeof(struct kv_key),
+    .key_offset = offsetof(struct kv_entry, key),
+    .head_offset = offsetof(struct kv_entry, node),
+    .hashfn = kv_hash,
+    .automatic_shrinking = true,
+};
+
+static void kv_entry_free(struct kv_entry* e) {
+    quantum_put(e->val);
+    kfree(e);
+}
+
+static void kv_entry_free_rcu(struct rcu_head* head) {
+    kv_entry_free(container_of(head, struct kv_entry, rcu));
+}
+
+// only when nobody can reach the table anymore
+static void kv_entry_free_now(void* ptr, void* arg) {
+    kv_entry_free(ptr);
+}
+
+// removes every entry, gets, puts and deletes may keep running meanwhile
+static void kv_clear(struct skull_d* dev) {
+    struct rhashtable_iter iter;
+    struct kv_entry* e;
+    int freed = 0;
+    rhashtable_walk_enter(&dev->kv, &iter);
+    rhashtable_walk_start(&iter);
+    while ((e = rhashtable_walk_next(&iter))) {
+        // -EAGAIN is a resize, the walk starts over by itself
+        if (IS_ERR(e)) continue;
+        if (!rhashtable_remove_fast(&dev->kv, &e->node, kvParams)) {
+            call_rcu(&e->rcu, kv_entry_free_rcu);
+        }
+        // the walk holds the rcu read lock, we let go of it once in a while
+        if (++freed % TRIM_BATCH == 0) {
+            rhashtable_walk_stop(&iter);
+            cond_resched();
+            rhashtable_walk_start(&iter);
+        }
+    }
+    rhashtable_walk_stop(&iter);
+    rhashtable_walk_exit(&iter);
+}
+
+// sets the geometry, and the shifts slotAt uses instead of dividing when both are powers of two
+static void skull_geometry(struct skull_d* dev, int quantum, int qset) {
+    dev->quantum = quantum;
+    dev->qset = qset;
+    dev->qShift = dev->pageShift = -1;
+    if (quantum > 0 && qset > 0 && is_power_of_2(quantum) && is_power_of_2(qset)) {
+        dev->qShift = ilog2(quantum);
+        dev->pageShift = dev->qShift + ilog2(qset);
+    }
+}
+
+// empties the device and hands back the old list and extents, must hold dev->lock
+static struct node* skull_detach(struct skull_d* dev, int* qset, struct rb_root* extents) {
+    struct node* old = dev->data;
+    *qset = dev->qset;
+    *extents = dev->extents;
+    dev->extents = RB_ROOT;
+    // the inline data is tiny, we can drop it right here
+    quantum_put(dev->small);
+    dev->small = NULL;
+    skull_geometry(dev, quantum_size, qset_size);
     dev->data = NULL;
+    // ring writers don't take dev->lock, they look at these under the ring lock
+    spin_lock(&dev->ringLock);
+    // only a device that has its own ring can become one
+    dev->engine = engine_kind == SKULL_ENGINE_RING && !dev->ring ? SKULL_ENGINE_QSET : engine_kind;
+    dev->size = 0;
+    dev->ringHead = 0;
+    spin_unlock(&dev->ringLock);
+    dev->generation++;
+    wake_followers(dev);
+    return old;
+}
+
+int skull_trim(struct skull_d* dev) {
+    struct rb_root extents;
+    struct node* old;
+    int qset;
+
+    old = skull_detach(dev, &qset, &extents);
+    free_nodes(old, qset);
+    free_extents(&extents);
+    kv_clear(dev);
     return 0;
 }
 
+// the parts of a device that need initializing, for skull0 and for the private instances
+static int skull_dev_init(struct skull_d* dev) {
+    mutex_init(&dev->lock);
+    init_waitqueue_head(&dev->readq);
+    spin_lock_init(&dev->ringLock);
+    skull_geometry(dev, quantum_size, qset_size);
+    dev->engine = engine_kind;
+    return rhashtable_init(&dev->kv, &kvParams);
+}
+
+static int ring_prepare(struct skull_d* dev);
+
+// a private instance lives as long as the open that created it, like scullpriv in LDD3
+static struct skull_d* priv_create(void) {
+    struct skull_d* dev = kzalloc(sizeof(struct skull_d), GFP_KERNEL);
+    if (!dev) return NULL;
+    if (skull_dev_init(dev)) {
+        kfree(dev);
+        return NULL;
+    }
+    dev->priv = true;
+    if (dev->engine == SKULL_ENGINE_RING && ring_prepare(dev)) {
+        rhashtable_destroy(&dev->kv);
+        kfree(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+static void priv_destroy(struct skull_d* dev) {
+    skull_trim(dev);
+    // kv_clear left the entries to rcu, the table itself is empty now
+    rhashtable_free_and_destroy(&dev->kv, kv_entry_free_now, NULL);
+    vfree(dev->ring);
+    kfree(dev);
+}
+
 static int open(struct inode* inode, struct file* filp) {
     // Getting char device struct and adding it to private_data field
     struct skull_d* dev;
-    dev = container_of(inode->i_cdev, struct skull_d, skull_cdev);
-    filp->private_data = dev;
-    // Checking access mode with f_flags
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+    struct skull_file* sfile;
+    struct rb_root oldExtents;
+    struct node* old;
+    int oldQset;
+    u64 lockedAt;
+    if (inode->i_cdev == &privCdev) {
+        dev = priv_create();
+        if (!dev) return -ENOMEM;
+    }
+    else {
+        dev = container_of(inode->i_cdev, struct skull_d, skull_cdev);
+    }
+    // each open gets its own cursor, so we wrap the device
+    sfile = kzalloc(sizeof(struct skull_file), GFP_KERNEL);
+    if (!sfile) goto nomem;
+    sfile->dev = dev;
+    mutex_init(&sfile->wcLock);
+    // ring writers never allocate, so their stage is ready from the start
+    if (READ_ONCE(dev->engine) == SKULL_ENGINE_RING && (filp->f_mode & FMODE_WRITE)) {
+        sfile->ringStage = kmalloc(SKULL_RING_RECORD_MAX, GFP_KERNEL);
+        if (!sfile->ringStage) {
+            kfree(sfile);
+            goto nomem;
+        }
+    }
+    filp->private_data = sfile;
+    // Checking access mode with f_flags, a private instance is born empty anyway
+    if ((filp->f_flags & O_ACCMODE) == O_WRONLY && !dev->priv) {
         pr_info("%s - [PID %d ] - about to GET the lock to OPEN device!", PREF, current->pid);
-        if (mutex_lock_interruptible(&dev->lock)) {
+        if (lock_dev(dev, SKULL_FOP_OPEN, &lockedAt, true)) {
             pr_alert("%s - we were killed while waiting");
+            kfree(sfile->ringStage);
+            kfree(sfile);
+            filp->private_data = NULL;
             return -ERESTARTSYS;
         }
         pr_info("%s - About to trim on open\n", PREF);
-        skull_trim(dev);
+        // we only unlink the data while holding the lock, freeing it can happen after
+        old = skull_detach(dev, &oldQset, &oldExtents);
         pr_info("%s - [PID %d ] - about to RELEASE lock after trimming!", PREF, current->pid);
-        mutex_unlock(&dev->lock);
+        unlock_dev(dev, SKULL_FOP_OPEN, lockedAt);
+        free_nodes(old, oldQset);
+        free_extents(&oldExtents);
+        kv_clear(dev);
     }
     return 0;
+
+nomem:
+    if (dev->priv) priv_destroy(dev);
+    return -ENOMEM;
 };
 
-static ssize_t read(struct file* filp, char __user* buf, size_t len, loff_t* off) {
-    struct skull_d* dev;
-    struct node* targetNode;
-    int quantum, qset, pageSize, nodeIndex, s_pos, q_pos, rest;
+static int wc_sync(struct skull_file* sfile);
+
+/*
+ * Ring engine: a fixed buffer allocated when the engine is chosen, never grown.
+ * Offsets are sequence numbers, byte n of everything ever written since the last trim,
+ * and only the last ringCap of them are kept. Writers append wherever they are asked
+ * to write, copying into a per open stage first so the ring lock is a spinlock held
+ * only for a memcpy. Readers copy without any lock and check afterwards that nobody
+ * lapped them meanwhile, starting over from the oldest byte when somebody did.
+ */
+static int ring_prepare(struct skull_d* dev) {
+    char* ring;
+    u64 lockedAt;
+
+    if (READ_ONCE(dev->ring)) return 0;
+    ring = vzalloc(ring_size);
+    if (!ring) return -ENOMEM;
+    lock_dev(dev, SKULL_FOP_IOCTL, &lockedAt, false);
+    if (!dev->ring) {
+        dev->ringCap = ring_size;
+        // ringCap has to be there before anybody sees the ring
+        smp_store_release(&dev->ring, ring);
+        ring = NULL;
+    }
+    unlock_dev(dev, SKULL_FOP_IOCTL, lockedAt);
+    vfree(ring);
+    return 0;
+}
+
+static void ring_window(struct skull_d* dev, u64* head, u64* tail) {
+    spin_lock(&dev->ringLock);
+    *head = dev->ringHead;
+    spin_unlock(&dev->ringLock);
+    *tail = *head > dev->ringCap ? *head - dev->ringCap : 0;
+}
+
+static ssize_t ring_write(struct skull_file* sfile, const char __user* buf, size_t len, loff_t* off) {
+    struct skull_d* dev = sfile->dev;
+    size_t n, first;
     ssize_t result;
+    char* stage;
+    u32 pos;
+
+    n = min3(len, (size_t)SKULL_RING_RECORD_MAX, dev->ringCap);
+    // we take the stage instead of locking it, a thread that finds it taken by another
+    // one writing the same open file, or missing because the engine changed after the
+    // open, uses one of its own for this call
+    stage = xchg(&sfile->ringStage, NULL);
+    if (!stage) {
+        stage = kmalloc(SKULL_RING_RECORD_MAX, GFP_KERNEL);
+        if (!stage) return -ENOMEM;
+    }
+    if (copy_from_user(stage, buf, n)) {
+        result = -EFAULT;
+        goto out;
+    }
+    spin_lock(&dev->ringLock);
+    if (dev->engine != SKULL_ENGINE_RING) {
+        // a trim switched engines while we were copying
+        spin_unlock(&dev->ringLock);
+        result = -EOPNOTSUPP;
+        goto out;
+    }
+    div_u64_rem(dev->ringHead, dev->ringCap, &pos);
+    first = min_t(size_t, n, dev->ringCap - pos);
+    memcpy(dev->ring + pos, stage, first);
+    memcpy(dev->ring, stage + first, n - first);
+    dev->ringHead += n;
+    WRITE_ONCE(dev->size, dev->ringHead);
+    *off = dev->ringHead;
+    spin_unlock(&dev->ringLock);
+    wake_followers(dev);
+    result = n;
+out:
+    // the open keeps one stage, a second one goes away
+    if (cmpxchg(&sfile->ringStage, NULL, stage)) {
+        kfree(stage);
+    }
+    return result;
+}
+
+static ssize_t ring_read(struct skull_file* sfile, char __user* buf, size_t len, loff_t* off) {
+    struct skull_d* dev = sfile->dev;
+    u64 head, tail;
+    size_t n;
+    u32 pos;
+
+    for (;;) {
+        ring_window(dev, &head, &tail);
+        // lapped, what we wanted is gone, so we continue from the oldest byte still there
+        if (*off < tail) *off = tail;
+        if (*off >= head) return 0;
+        n = min_t(u64, len, head - *off);
+        div_u64_rem(*off, dev->ringCap, &pos);
+        n = min_t(size_t, n, dev->ringCap - pos);
+        if (copy_to_user(buf, dev->ring + pos, n)) return -EFAULT;
+        // still valid only if no writer reached our bytes while we copied
+        ring_window(dev, &head, &tail);
+        if (tail <= *off) break;
+    }
+    *off += n;
+    return n;
+}
+
+static ssize_t read_once(struct skull_file* sfile, char __user* buf, size_t len, loff_t* off) {
+    struct skull_d* dev = sfile->dev;
+    struct quantum* q;
+    size_t qOff, avail;
+    ssize_t result;
+    u64 lockedAt;
+
+    if (READ_ONCE(dev->engine) == SKULL_ENGINE_RING) {
+        return ring_read(sfile, buf, len, off);
+    }
 
-    dev = filp->private_data;
-    targetNode = dev->data;
-    quantum = dev->quantum;
-    qset = dev->qset;
-    pageSize = quantum * qset;
-    result = 0;
     pr_info("%s - [PID %d ] - about to GET the lock to READ!", PREF, current->pid);
-    if (mutex_lock_interruptible(&dev->lock)) {
+    if (lock_dev(dev, SKULL_FOP_READ, &lockedAt, true)) {
         pr_alert("%s - we were killed while waiting");
         return -ERESTARTSYS;
     }
-    pr_info("%s - [PID %d ] - GOT the lock for READING!", PREF, current->pid);
-    if (dev->size < *off) {
-        goto out;
+    pr_debug("%s - [PID %d ] - GOT the lock for READING!", PREF, current->pid);
+    if (dev->size <= *off) {
+        unlock_dev(dev, SKULL_FOP_READ, lockedAt);
+        return 0;
     }
     if (*off + len > dev->size) {
         len = dev->size - *off;
     }
+    q = quantumAt(dev, &sfile->cursor, *off, &qOff, &avail, NULL);
+    // the reference keeps the quantum alive even if somebody trims while we copy
+    if (q) refcount_inc(&q->ref);
+    pr_debug("%s - [PID %d ] - about to RELEASE the lock after READING!", PREF, current->pid);
+    unlock_dev(dev, SKULL_FOP_READ, lockedAt);
 
-    nodeIndex = (long)*off / pageSize;
-    rest = (long)*off % pageSize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-    targetNode = getNodeByIndex(dev, nodeIndex);
+    if (len > avail) {
+        len = avail;
+    }
+    // a hole in a sparse device reads as zeros
+    if (q ? copy_to_user(buf, q->data + qOff, len) : clear_user(buf, len)) {
+        result = -EFAULT;
+    }
+    else {
+        *off = *off + len;
+        result = len;
+    }
+    quantum_put(q);
+    return result;
 
-    if (targetNode == NULL || !targetNode->data || !targetNode->data[s_pos]) {
-        goto out;
+}
+
+static ssize_t read(struct file* filp, char __user* buf, size_t len, loff_t* off) {
+    struct skull_file* sfile = filp->private_data;
+    struct skull_d* dev = sfile->dev;
+    unsigned long generation;
+    ssize_t result;
+
+    // our own staged writes must be visible to our reads
+    result = wc_sync(sfile);
+    if (result) {
+        return result;
+    }
+    for (;;) {
+        generation = READ_ONCE(dev->generation);
+        result = read_once(sfile, buf, len, off);
+        if (result || !len || !READ_ONCE(sfile->follow)) {
+            return result;
+        }
+        // following: instead of EOF we wait for somebody to write past us.
+        // the size only grows once a copy landed, see dev_write_done
+        if (filp->f_flags & O_NONBLOCK) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(dev->readq, READ_ONCE(dev->size) > *off ||
+            READ_ONCE(dev->generation) != generation || !READ_ONCE(sfile->follow))) {
+            return -ERESTARTSYS;
+        }
+        // a trim emptied the device, the follower gets its EOF to notice
+        if (READ_ONCE(dev->generation) != generation) {
+            return 0;
+        }
+    }
+}
+
+// without follow a read at the end returns 0 right away, which counts as readable
+static unsigned int poll(struct file* filp, poll_table* wait) {
+    struct skull_file* sfile = filp->private_data;
+    struct skull_d* dev = sfile->dev;
+    unsigned int mask = POLLOUT | POLLWRNORM;
+
+    poll_wait(filp, &dev->readq, wait);
+    if (!READ_ONCE(sfile->follow) || READ_ONCE(dev->size) > filp->f_pos) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+    return mask;
+}
+
+static u32 quantum_rem(u64 off, int quantum) {
+    u32 rem;
+    if (is_power_of_2(quantum)) return off & (quantum - 1);
+    div_u64_rem(off, quantum, &rem);
+    return rem;
+}
+
+// appending at the start of a quantum will most likely need a new one, so we get it early
+static void prealloc_guess(struct skull_d* dev, struct prealloc* pre, loff_t off) {
+    int quantum = READ_ONCE(dev->quantum);
+    u32 rest;
+    // extents are sized after the write, the first round will ask for the right one
+    if (READ_ONCE(dev->engine) == SKULL_ENGINE_EXTENT) return;
+    rest = quantum_rem(off, quantum);
+    // the first write to an empty device goes inline, a whole quantum would be wasted
+    if (!READ_ONCE(dev->data) && !READ_ONCE(dev->small) && off < inline_max) {
+        pre->needSmall = true;
+    }
+    else if (off >= READ_ONCE(dev->size) && rest == 0) {
+        pre->needQuantum = true;
+    }
+    else {
+        return;
+    }
+    if (prealloc_fill(pre, quantum, READ_ONCE(dev->qset))) {
+        pre->needQuantum = false;
+        pre->needSmall = false;
+    }
+}
+
+/*
+ * Finds and pins the quantum where a write of *len bytes at off lands. *len is trimmed
+ * to what fits there, the caller copies, puts the quantum and calls dev_write_done
+ * with the generation we saw, the size doesn't cover the write until then.
+ */
+static int dev_write_pin(struct skull_d* dev, struct skull_cursor* cursor, loff_t off, size_t* len,
+    struct quantum** pinned, size_t* pinnedOff, unsigned long* generation, bool interruptible) {
+    struct prealloc pre = { 0 };
+    struct quantum* q;
+    size_t qOff, avail;
+    u64 lockedAt;
+
+    pre.want = *len;
+    prealloc_guess(dev, &pre, off);
+    for (;;) {
+        pr_info("%s - [PID %d ] - about to GET the lock to WRITE!", PREF, current->pid);
+        if (lock_dev(dev, SKULL_FOP_WRITE, &lockedAt, interruptible)) {
+            pr_alert("%s - we were killed while waiting", PREF);
+            prealloc_release(&pre);
+            return -ERESTARTSYS;
+        }
+        pr_debug("%s - [PID %d ] - GOT the lock for WRITING!", PREF, current->pid);
+        // the ring has no quanta, we only get here if a trim switched engines under us
+        if (dev->engine == SKULL_ENGINE_RING) {
+            unlock_dev(dev, SKULL_FOP_WRITE, lockedAt);
+            prealloc_release(&pre);
+            return -EOPNOTSUPP;
+        }
+        q = quantumAt(dev, cursor, off, &qOff, &avail, &pre);
+        if (q) break;
+        // something is missing, allocate it without the lock and look again
+        unlock_dev(dev, SKULL_FOP_WRITE, lockedAt);
+        if (prealloc_fill(&pre, READ_ONCE(dev->quantum), READ_ONCE(dev->qset))) {
+            prealloc_release(&pre);
+            return -ENOMEM;
+        }
     }
-    if (len > quantum - q_pos) {
-        len = quantum - q_pos;
+    if (*len > avail) {
+        *len = avail;
     }
-    if (copy_to_user(buf, targetNode->data[s_pos] + q_pos, len)) {
+    refcount_inc(&q->ref);
+    *generation = dev->generation;
+    pr_debug("%s - [PID %d ] - about to RELEASE the lock after WRITING!", PREF, current->pid);
+    unlock_dev(dev, SKULL_FOP_WRITE, lockedAt);
+    prealloc_release(&pre);
+    *pinned = q;
+    *pinnedOff = qOff;
+    return 0;
+}
+
+/*
+ * Grows the size over a write whose copy landed, so a faulting copy leaves the size alone
+ * and readers never get past bytes that are still being copied. Overwrites don't need the
+ * lock again. After a trim the quantum we wrote is gone and there is nothing to grow.
+ */
+static void dev_write_done(struct skull_d* dev, loff_t end, unsigned long generation) {
+    u64 lockedAt;
+    if (READ_ONCE(dev->size) < end) {
+        lock_dev(dev, SKULL_FOP_WRITE, &lockedAt, false);
+        if (dev->generation == generation && dev->size < end) {
+            dev->size = end;
+        }
+        unlock_dev(dev, SKULL_FOP_WRITE, lockedAt);
+    }
+    wake_followers(dev);
+}
+
+static int write_pin(struct skull_file* sfile, loff_t off, size_t* len, struct quantum** pinned, size_t* pinnedOff,
+    unsigned long* generation) {
+    return dev_write_pin(sfile->dev, &sfile->cursor, off, len, pinned, pinnedOff, generation, true);
+}
+
+static ssize_t write_through(struct skull_file* sfile, const char __user* buf, size_t len, loff_t* off) {
+    unsigned long generation;
+    struct quantum* q;
+    size_t qOff;
+    ssize_t result;
+
+    result = write_pin(sfile, *off, &len, &q, &qOff, &generation);
+    if (result) {
+        return result;
+    }
+    quantum_write_begin(q);
+    if (copy_from_user(q->data + qOff, buf, len)) {
         result = -EFAULT;
-        goto out;
     }
+    else {
+        result = len;
+    }
+    quantum_write_end(q);
+    quantum_put(q);
+    if (result > 0) {
+        dev_write_done(sfile->dev, *off + len, generation);
+        *off = *off + len;
+    }
+    return result;
+}
+
+/*
+ * Write combining: small writes are staged in a per open buffer and committed
+ * to the quantum store in one go, taking the device lock only once.
+ * The staged bytes are always one contiguous range starting at wcStart.
+ * Must hold sfile->wcLock.
+ */
+static int wc_flush(struct skull_file* sfile, bool interruptible) {
+    struct prealloc pre = { 0 };
+    struct skull_d* dev = sfile->dev;
+    loff_t pos = sfile->wcStart;
+    size_t done = 0, qOff, avail, n;
+    struct quantum* q;
+    u64 lockedAt;
+    int err;
+
+    if (!sfile->wcLen) return 0;
+    if (lock_dev(dev, SKULL_FOP_WRITE, &lockedAt, interruptible)) {
+        return -ERESTARTSYS;
+    }
+    if (dev->engine == SKULL_ENGINE_RING) {
+        unlock_dev(dev, SKULL_FOP_WRITE, lockedAt);
+        return -EOPNOTSUPP;
+    }
+    while (done < sfile->wcLen) {
+        pre.want = sfile->wcLen - done;
+        q = quantumAt(dev, &sfile->cursor, pos, &qOff, &avail, &pre);
+        if (q == NULL) {
+            // same as write, allocations happen without the lock.
+            // if we fail we keep the whole buffer, writing it again later is harmless
+            unlock_dev(dev, SKULL_FOP_WRITE, lockedAt);
+            err = prealloc_fill(&pre, READ_ONCE(dev->quantum), READ_ONCE(dev->qset));
+            if (!err && lock_dev(dev, SKULL_FOP_WRITE, &lockedAt, interruptible)) {
+                err = -ERESTARTSYS;
+            }
+            if (err) {
+                prealloc_release(&pre);
+                return err;
+            }
+            continue;
+        }
+        // kernel to kernel copies can't fault, so this one stays under the lock
+        n = min(avail, sfile->wcLen - done);
+        quantum_write_begin(q);
+        memcpy(q->data + qOff, sfile->wcBuf + done, n);
+        quantum_write_end(q);
+        done += n;
+        pos += n;
+    }
+    if (dev->size < pos) {
+        dev->size = pos;
+    }
+    unlock_dev(dev, SKULL_FOP_WRITE, lockedAt);
+    prealloc_release(&pre);
+    sfile->wcLen = 0;
+    wake_followers(dev);
+    return 0;
+}
+
+// commits whatever is staged, used before reading and from fsync, ioctl and release
+static int wc_sync(struct skull_file* sfile) {
+    int err;
+    if (!sfile->wcBuf) return 0;
+    mutex_lock(&sfile->wcLock);
+    err = wc_flush(sfile, true);
+    mutex_unlock(&sfile->wcLock);
+    return err;
+}
+
+// changes the staging buffer size, 0 turns write combining off
+static int wc_resize(struct skull_file* sfile, unsigned long size) {
+    char* newBuf = NULL;
+    int err;
+
+    if (size > SKULL_WC_MAX) return -EINVAL;
+    if (size) {
+        newBuf = kvmalloc(size, GFP_KERNEL);
+        if (!newBuf) return -ENOMEM;
+    }
+    mutex_lock(&sfile->wcLock);
+    err = wc_flush(sfile, true);
+    if (err) {
+        mutex_unlock(&sfile->wcLock);
+        kvfree(newBuf);
+        return err;
+    }
+    kvfree(sfile->wcBuf);
+    sfile->wcBuf = newBuf;
+    sfile->wcCap = size;
+    mutex_unlock(&sfile->wcLock);
+    return 0;
+}
+
+static ssize_t write(struct file* filp, const char __user* buf, size_t len, loff_t* off) {
+    struct skull_file* sfile;
+    ssize_t result;
+    int err;
+
+    sfile = filp->private_data;
+    if (READ_ONCE(sfile->dev->engine) == SKULL_ENGINE_RING) {
+        return ring_write(sfile, buf, len, off);
+    }
+    if (!sfile->wcBuf) {
+        return write_through(sfile, buf, len, off);
+    }
+
+    mutex_lock(&sfile->wcLock);
+    // only writes that continue the staged range and fit in the buffer are combined
+    if (sfile->wcLen && (*off != sfile->wcStart + sfile->wcLen || sfile->wcLen + len > sfile->wcCap)) {
+        err = wc_flush(sfile, true);
+        if (err) {
+            mutex_unlock(&sfile->wcLock);
+            return err;
+        }
+    }
+    if (len > sfile->wcCap) {
+        mutex_unlock(&sfile->wcLock);
+        return write_through(sfile, buf, len, off);
+    }
+    if (!sfile->wcLen) {
+        sfile->wcStart = *off;
+    }
+    if (copy_from_user(sfile->wcBuf + sfile->wcLen, buf, len)) {
+        mutex_unlock(&sfile->wcLock);
+        return -EFAULT;
+    }
+    sfile->wcLen += len;
     *off = *off + len;
     result = len;
+    // a full buffer is committed right away, if that fails the bytes stay
+    // staged and the error shows up in the next write, fsync or flush ioctl
+    if (sfile->wcLen == sfile->wcCap) {
+        wc_flush(sfile, true);
+    }
+    mutex_unlock(&sfile->wcLock);
+    return result;
+}
+
+static int fsync(struct file* filp, loff_t start, loff_t end, int datasync) {
+    return wc_sync(filp->private_data);
+}
+
+static int release(struct inode* inode, struct file* filp) {
+    struct skull_file* sfile = filp->private_data;
+    if (sfile->wcBuf) {
+        // this is the last chance to commit, so we are not interruptible here
+        mutex_lock(&sfile->wcLock);
+        if (wc_flush(sfile, false)) {
+            pr_alert("%s - [PID %d ] - lost %zu staged bytes on release", PREF, current->pid, sfile->wcLen);
+        }
+        mutex_unlock(&sfile->wcLock);
+        kvfree(sfile->wcBuf);
+    }
+    if (sfile->dev->priv) {
+        priv_destroy(sfile->dev);
+    }
+    kfree(sfile->ringStage);
+    kfree(sfile);
+    return 0;
+}
+
+static loff_t llseek(struct file* filp, loff_t off, int whence) {
+    struct skull_file* sfile;
+    struct skull_d* dev;
+    loff_t newpos;
+    int err;
+    sfile = filp->private_data;
+    dev = sfile->dev;
+    switch (whence) {
+    case 0: /* SEEK_SET */
+        newpos = off;
+        break;
+
+    case 1: /* SEEK_CUR */
+        newpos = filp->f_pos + off;
+        break;
+
+    case 2: /* SEEK_END */
+        err = wc_sync(sfile);
+        if (err) return err;
+        newpos = dev->size + off;
+        break;
+
+    default: /* can't happen */
+        return -EINVAL;
+    }
+    if (newpos < 0) return -EINVAL;
+    filp->f_pos = newpos;
+    return newpos;
+}
+
+
+static const struct file_operations fops;
+
+// copies through pinned quanta, the bytes never leave the kernel
+static int copy_range(struct skull_file* src, struct skull_file* dst, struct skull_range* range) {
+    struct skull_d* dev = src->dev;
+    unsigned long generation;
+    struct quantum* from;
+    struct quantum* to;
+    size_t fromOff, toOff, avail, n;
+    loff_t in = range->src_off, out = range->dst_off;
+    u64 done = 0, lockedAt;
+    char* bounce = NULL;
+    bool bounced;
+    int err = 0;
+
+    while (done < range->len) {
+        if (lock_dev(dev, SKULL_FOP_IOCTL, &lockedAt, true)) {
+            err = -ERESTARTSYS;
+            break;
+        }
+        if (in >= dev->size) {
+            unlock_dev(dev, SKULL_FOP_IOCTL, lockedAt);
+            break;
+        }
+        from = quantumAt(dev, &src->cursor, in, &fromOff, &avail, NULL);
+        n = min3((u64)avail, range->len - done, dev->size - in);
+        // a pinned inline quantum can't move to the list, and writing past it on the same
+        // device has to move it, so we would wait for our own pin. it is tiny, we copy it out
+        bounced = from && from == dev->small;
+        if (bounced && !bounce) {
+            unlock_dev(dev, SKULL_FOP_IOCTL, lockedAt);
+            bounce = kmalloc(inline_max, GFP_KERNEL);
+            if (!bounce) {
+                err = -ENOMEM;
+                break;
+            }
+            continue;
+        }
+        if (bounced) {
+            memcpy(bounce, from->data + fromOff, n);
+            from = NULL;
+        }
+        if (from) refcount_inc(&from->ref);
+        unlock_dev(dev, SKULL_FOP_IOCTL, lockedAt);
+
+        err = write_pin(dst, out, &n, &to, &toOff, &generation);
+        if (!err) {
+            // memmove, in and out can be the same quantum of the same device
+            quantum_write_begin(to);
+            if (from) memmove(to->data + toOff, from->data + fromOff, n);
+            else if (bounced) memcpy(to->data + toOff, bounce, n);
+            else memset(to->data + toOff, 0, n);
+            quantum_write_end(to);
+            quantum_put(to);
+            dev_write_done(dst->dev, out + n, generation);
+        }
+        quantum_put(from);
+        if (err) break;
+        in += n;
+        out += n;
+        done += n;
+        if (fatal_signal_pending(current)) break;
+        cond_resched();
+    }
+    kfree(bounce);
+    range->len = done;
+    return done ? 0 : err;
+}
+
+// locks both devices in address order, so two clones going opposite ways can't deadlock
+static int lock_pair(struct skull_d* a, struct skull_d* b, u64* lockedAt) {
+    struct skull_d* first = a < b ? a : b;
+    struct skull_d* second = a < b ? b : a;
+    if (lock_dev(first, SKULL_FOP_IOCTL, &lockedAt[0], true)) return -ERESTARTSYS;
+    if (first != second && lock_dev_nested(second, SKULL_FOP_IOCTL, &lockedAt[1], true, SINGLE_DEPTH_NESTING)) {
+        unlock_dev(first, SKULL_FOP_IOCTL, lockedAt[0]);
+        return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+static void unlock_pair(struct skull_d* a, struct skull_d* b, u64* lockedAt) {
+    struct skull_d* first = a < b ? a : b;
+    struct skull_d* second = a < b ? b : a;
+    if (first != second) unlock_dev(second, SKULL_FOP_IOCTL, lockedAt[1]);
+    unlock_dev(first, SKULL_FOP_IOCTL, lockedAt[0]);
+}
+
+#define CLONE_BATCH 64 /* quanta shared per lock round */
+
+/*
+ * Reflink: the destination slots point to the source quanta, no data is copied.
+ * Both sides then write through treeQuantumAt, which copies a shared quantum first.
+ * Only for the qset engine without inline data, with the same quantum size on both
+ * devices and quantum aligned ranges (the end may be unaligned if it is the end of both).
+ */
+static int clone_range(struct skull_file* src, struct skull_file* dst, struct skull_range* range) {
+    struct skull_d* from = src->dev;
+    struct skull_d* to = dst->dev;
+    struct prealloc pre = { 0 };
+    struct quantum** slot;
+    struct quantum* q;
+    struct quantum* old;
+    size_t qOff, avail;
+    u64 done = 0, end, lockedAt[2];
+    int err, batch;
+
+    err = lock_pair(from, to, lockedAt);
+    if (err) return err;
+    for (;;) {
+        err = -EOPNOTSUPP;
+        if (from->engine != SKULL_ENGINE_QSET || to->engine != SKULL_ENGINE_QSET || from->small || to->small) break;
+        err = -EINVAL;
+        if (from->quantum != to->quantum) break;
+        if (from == to && range->src_off < range->dst_off + range->len && range->dst_off < range->src_off + range->len) break;
+        if (quantum_rem(range->src_off, from->quantum) || quantum_rem(range->dst_off, from->quantum)) break;
+        // only whole quanta, unless we run to the end of both devices
+        if (range->src_off + range->len > from->size) range->len = from->size - min_t(u64, range->src_off, from->size);
+        end = quantum_rem(range->len, from->quantum);
+        if (end && (range->src_off + range->len < from->size || range->dst_off + range->len < to->size)) break;
+        err = 0;
+
+        for (batch = 0; done < range->len && batch < CLONE_BATCH; batch++) {
+            slot = slotAt(to, &dst->cursor, range->dst_off + done, &qOff, &avail, &pre);
+            if (!slot) break;
+            q = treeQuantumAt(from, &src->cursor, range->src_off + done, &qOff, &avail, NULL);
+            // a copy still in flight could land after the clone, wait until it is done
+            if (q && refcount_read(&q->ref) > atomic_read(&q->owners)) {
+                pre.busy = true;
+                break;
+            }
+            old = *slot;
+            if (q) {
+                refcount_inc(&q->ref);
+                atomic_inc(&q->owners);
+            }
+            *slot = q;
+            slot_put(old);
+            done += min_t(u64, avail, range->len - done);
+            if (to->size < range->dst_off + done) {
+                to->size = range->dst_off + done;
+            }
+        }
+        if (done >= range->len) break;
+        unlock_pair(from, to, lockedAt);
+        err = prealloc_fill(&pre, READ_ONCE(to->quantum), READ_ONCE(to->qset));
+        if (!err && fatal_signal_pending(current)) err = -EINTR;
+        if (!err) {
+            cond_resched();
+            err = lock_pair(from, to, lockedAt);
+        }
+        if (err) {
+            prealloc_release(&pre);
+            range->len = done;
+            return done ? 0 : err;
+        }
+    }
+    unlock_pair(from, to, lockedAt);
+    prealloc_release(&pre);
+    if (done) wake_followers(to);
+    range->len = done;
+    return done ? 0 : err;
+}
+
+// SKULL_IOC_COPY_RANGE and SKULL_IOC_CLONE_RANGE, filp is the destination
+static long range_ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
+    struct skull_range range;
+    struct file* src;
+    long result;
+
+    if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+    if (copy_from_user(&range, (void __user*)arg, sizeof(range))) return -EFAULT;
+    if (range.src_off > LLONG_MAX || range.dst_off > LLONG_MAX ||
+        range.len > LLONG_MAX - max(range.src_off, range.dst_off)) {
+        return -EINVAL;
+    }
+    src = fget(range.src_fd);
+    if (!src) return -EBADF;
+    if (src->f_op != &fops) {
+        result = -EXDEV;
+        goto out;
+    }
+    // ring offsets are sequence numbers, copying them around makes no sense
+    if (READ_ONCE(((struct skull_file*)src->private_data)->dev->engine) == SKULL_ENGINE_RING ||
+        READ_ONCE(((struct skull_file*)filp->private_data)->dev->engine) == SKULL_ENGINE_RING) {
+        result = -EOPNOTSUPP;
+        goto out;
+    }
+    if (!(src->f_mode & FMODE_READ)) {
+        result = -EBADF;
+        goto out;
+    }
+    // staged writes on either side have to be in the devices first
+    result = wc_sync(src->private_data);
+    if (!result) result = wc_sync(filp->private_data);
+    if (result) goto out;
+    if (cmd == SKULL_IOC_COPY_RANGE) {
+        result = copy_range(src->private_data, filp->private_data, &range);
+    }
+    else {
+        result = clone_range(src->private_data, filp->private_data, &range);
+    }
+    if (!result && put_user(range.len, &((struct skull_range __user*)arg)->len)) {
+        result = -EFAULT;
+    }
 out:
-    pr_info("%s - [PID %d ] - about to RELEASE the lock after READING!", PREF, current->pid);
-    mutex_unlock(&dev->lock);
+    fput(src);
     return result;
+}
+
+/*
+ * Finds the first populated chunk at or after *pos and pins its quantum, must hold dev->lock.
+ * A chunk is a quantum, an extent or the inline data, and *pos is moved to its start,
+ * which is *qOff bytes into the quantum (only an extent that grew since we saw it has one).
+ * Arrays that were never allocated are skipped whole, so holes cost one step per node.
+ */
+static struct quantum* nextPopulated(struct skull_d* dev, struct skull_cursor* cursor, u64* pos, u32* len, u32* qOff) {
+    struct skull_extent* e;
+    struct rb_node* rb;
+    struct node* node;
+    u64 pageSize, nodeIndex, rest;
+    u32 slot;
 
+    *qOff = 0;
+    if (*pos >= dev->size) return NULL;
+    if (dev->engine == SKULL_ENGINE_EXTENT) {
+        e = extent_floor(&dev->extents, *pos);
+        if (!e || e->start + e->len <= *pos) {
+            rb = e ? rb_next(&e->rb) : rb_first(&dev->extents);
+            if (!rb) return NULL;
+            e = rb_entry(rb, struct skull_extent, rb);
+            *pos = e->start;
+        }
+        *qOff = *pos - e->start;
+        *len = e->len - *qOff;
+        refcount_inc(&e->q->ref);
+        return e->q;
+    }
+    if (dev->engine != SKULL_ENGINE_QSET) return NULL;
+    if (dev->small) {
+        // all of it is a single chunk at 0
+        if (*pos > 0) return NULL;
+        *len = min_t(u64, dev->size, dev->small->size);
+        refcount_inc(&dev->small->ref);
+        return dev->small;
+    }
+    pageSize = (u64)dev->quantum * dev->qset;
+    while (*pos < dev->size) {
+        nodeIndex = div64_u64_rem(*pos, pageSize, &rest);
+        node = getNodeByIndex(dev, cursor, nodeIndex, NULL);
+        if (!node) return NULL;
+        for (slot = div_u64(rest, dev->quantum); node->data && slot < dev->qset; slot++) {
+            if (node->data[slot]) {
+                *pos = nodeIndex * pageSize + (u64)slot * dev->quantum;
+                if (*pos >= dev->size) return NULL;
+                *len = min_t(u64, dev->quantum, dev->size - *pos);
+                refcount_inc(&node->data[slot]->ref);
+                return node->data[slot];
+            }
+        }
+        *pos = (nodeIndex + 1) * pageSize;
+    }
+    return NULL;
+}
+
+/*
+ * Checks the sums of the quanta in a range, writing the device offset where each bad one
+ * starts. Like the BPF iterator it pins one chunk per lock round and sums it unlocked.
+ */
+static long verify_range(struct skull_d* dev, struct skull_verify __user* arg) {
+    struct skull_cursor cursor = { 0 };
+    struct skull_verify v;
+    struct quantum* q;
+    u64 pos, end, lockedAt;
+    u32 len, qOff, found = 0;
+    long err = 0;
+    int bad;
+
+    if (!checksum || READ_ONCE(dev->engine) == SKULL_ENGINE_RING) return -EOPNOTSUPP;
+    if (copy_from_user(&v, arg, sizeof(v))) return -EFAULT;
+    v.checked = v.busy = 0;
+    end = v.len > U64_MAX - v.off ? U64_MAX : v.off + v.len;
+    pos = v.off;
+    while (pos < end) {
+        if (lock_dev(dev, SKULL_FOP_IOCTL, &lockedAt, true)) {
+            err = -ERESTARTSYS;
+            break;
+        }
+        q = nextPopulated(dev, &cursor, &pos, &len, &qOff);
+        unlock_dev(dev, SKULL_FOP_IOCTL, lockedAt);
+        if (!q || pos >= end) {
+            quantum_put(q);
+            break;
+        }
+        bad = quantum_verify(q);
+        if (bad < 0) v.busy++;
+        else v.checked += q->size;
+        quantum_put(q);
+        if (bad > 0) {
+            // the whole quantum is summed, so we report where it starts
+            if (found < v.nrBad && put_user(pos - qOff, (u64 __user*)u64_to_user_ptr(v.bad) + found)) {
+                err = -EFAULT;
+                break;
+            }
+            found++;
+        }
+        pos += len;
+        if (fatal_signal_pending(current)) {
+            err = -EINTR;
+            break;
+        }
+        cond_resched();
+    }
+    v.nrBad = found;
+    if (!err && copy_to_user(arg, &v, sizeof(v))) err = -EFAULT;
+    return err;
 }
 
-static ssize_t write(struct file* filp, const char __user* buf, size_t len, loff_t* off) {
-    struct skull_d* dev;
-    struct node* targetNode;
-    int quantum, qset, pageSize, nodeIndex, s_pos, q_pos, rest;
-    ssize_t result;
+static int kv_key_get(struct kv_key* key, struct skull_kv* kv) {
+    memset(key, 0, sizeof(*key));
+    if (kv->keyLen == 0 || kv->keyLen > SKULL_KV_KEY_MAX) return -EINVAL;
+    key->len = kv->keyLen;
+    if (copy_from_user(key->data, u64_to_user_ptr(kv->key), kv->keyLen)) return -EFAULT;
+    return 0;
+}
 
-    dev = filp->private_data;
-    targetNode = dev->data;
-    quantum = dev->quantum;
-    qset = dev->qset;
-    pageSize = quantum * qset;
-    result = -ENOMEM;
+static long kv_get(struct skull_d* dev, struct skull_kv __user* arg) {
+    struct skull_kv kv;
+    struct kv_key key;
+    struct kv_entry* e;
+    struct quantum* q = NULL;
+    u32 size;
+    long err;
 
-    pr_info("%s - [PID %d ] - about to GET the lock to WRITE!", PREF, current->pid);
-    if (mutex_lock_interruptible(&dev->lock)) {
-        pr_alert("%s - we were killed while waiting", PREF);
-        return -ERESTARTSYS;
+    if (copy_from_user(&kv, arg, sizeof(kv))) return -EFAULT;
+    err = kv_key_get(&key, &kv);
+    if (err) return err;
+    rcu_read_lock();
+    e = rhashtable_lookup(&dev->kv, &key, kvParams);
+    if (e) {
+        // the entry holds its value until the grace period ends, so this can't be the last ref
+        q = e->val;
+        refcount_inc(&q->ref);
     }
-    pr_info("%s - [PID %d ] - GOT the lock for WRITING!", PREF, current->pid);
+    rcu_read_unlock();
+    if (!q) return -ENOENT;
+    // a short buffer gets the beginning, valLen tells how much there was
+    size = q->size;
+    err = copy_to_user(u64_to_user_ptr(kv.val), q->data, min(kv.valLen, size)) ? -EFAULT : 0;
+    quantum_put(q);
+    if (!err && put_user(size, &arg->valLen)) err = -EFAULT;
+    return err;
+}
 
-    nodeIndex = (long)*off / pageSize;
-    rest = (long)*off % pageSize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
+static long kv_put(struct skull_d* dev, struct skull_kv __user* arg) {
+    struct skull_kv kv;
+    struct kv_entry* e;
+    struct kv_entry* old;
+    long err;
 
-    targetNode = getNodeByIndex(dev, nodeIndex);
-    if (targetNode == NULL) {
-        goto out;
-    }
-    if (!targetNode->data) {
-        targetNode->data = kmalloc(qset * sizeof(char*), GFP_KERNEL);
-        if (targetNode->data == NULL) {
-            goto out;
+    if (copy_from_user(&kv, arg, sizeof(kv))) return -EFAULT;
+    if (kv.valLen > SKULL_KV_VALUE_MAX) return -EINVAL;
+    e = kzalloc(sizeof(struct kv_entry), GFP_KERNEL);
+    if (!e) return -ENOMEM;
+    err = kv_key_get(&e->key, &kv);
+    if (err) goto fail;
+    err = -ENOMEM;
+    e->val = quantum_alloc(kv.valLen);
+    if (!e->val) goto fail;
+    quantum_write_begin(e->val);
+    err = copy_from_user(e->val->data, u64_to_user_ptr(kv.val), kv.valLen) ? -EFAULT : 0;
+    quantum_write_end(e->val);
+    if (err) goto fail;
+
+    // readers see the old value or the new one, never half of each.
+    // old can be freed by a racing put or delete as soon as it leaves the table, the
+    // rcu read section keeps it around until replace is done hashing its key
+    rcu_read_lock();
+    for (;;) {
+        old = rhashtable_lookup_get_insert_fast(&dev->kv, &e->node, kvParams);
+        if (!old) break;
+        if (IS_ERR(old)) {
+            rcu_read_unlock();
+            err = PTR_ERR(old);
+            goto fail;
         }
-        memset(targetNode->data, 0, qset * sizeof(char*));
-    }
-    if (!targetNode->data[s_pos]) {
-        targetNode->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-        if (!targetNode->data[s_pos]) {
-            goto out;
+        if (!rhashtable_replace_fast(&dev->kv, &old->node, &e->node, kvParams)) {
+            call_rcu(&old->rcu, kv_entry_free_rcu);
+            break;
         }
+        // somebody deleted it in between, insert again
     }
-    if (len > quantum - q_pos) {
-        len = quantum - q_pos;
-    }
-    if (copy_from_user(targetNode->data[s_pos] + q_pos, buf, len)) {
-        result = -EFAULT;
-        goto out;
-    }
-    *off = *off + len;
-    result = len;
-    if (dev->size < *off) {
-        dev->size = *off;
-    }
-out:
-    pr_info("%s - [PID %d ] - about to RELEASE the lock after WRITING!", PREF, current->pid);
-    mutex_unlock(&dev->lock);
-    return result;
+    rcu_read_unlock();
+    return 0;
 
+fail:
+    kv_entry_free(e);
+    return err;
 }
 
-static int release(struct inode* inode, struct file* filp) {
-    return 0;
-}
+static long kv_delete(struct skull_d* dev, struct skull_kv __user* arg) {
+    struct skull_kv kv;
+    struct kv_key key;
+    struct kv_entry* e;
+    long err;
 
-static loff_t llseek(struct file* filp, loff_t off, int whence) {
-    struct skull_d* dev;
-    loff_t newpos;
-    dev = filp->private_data;
-    switch (whence) {
-    case 0: /* SEEK_SET */
-        newpos = off;
-        break;
+    if (copy_from_user(&kv, arg, sizeof(kv))) return -EFAULT;
+    err = kv_key_get(&key, &kv);
+    if (err) return err;
+    err = -ENOENT;
+    rcu_read_lock();
+    e = rhashtable_lookup(&dev->kv, &key, kvParams);
+    // of two racing deletes only one removes it
+    if (e && !rhashtable_remove_fast(&dev->kv, &e->node, kvParams)) {
+        call_rcu(&e->rcu, kv_entry_free_rcu);
+        err = 0;
+    }
+    rcu_read_unlock();
+    return err;
+}
 
-    case 1: /* SEEK_CUR */
-        newpos = filp->f_pos + off;
-        break;
+/*
+ * The table has no order, so a scan is a walk that skips the first pos matching keys.
+ * Keys put or deleted between two calls may be missed or seen twice, and so may all
+ * of them if the table resizes in between.
+ */
+static long kv_scan(struct skull_d* dev, struct skull_kv_scan __user* arg) {
+    struct skull_kv_scan scan;
+    struct skull_kv_rec* recs;
+    struct rhashtable_iter iter;
+    struct kv_entry* e;
+    u64 seen = 0;
+    u32 n = 0;
+    long err = 0;
 
-    case 2: /* SEEK_END */
-        newpos = dev->size + off;
-        break;
+    if (copy_from_user(&scan, arg, sizeof(scan))) return -EFAULT;
+    if (scan.prefixLen > SKULL_KV_KEY_MAX) return -EINVAL;
+    scan.nr = min_t(u32, scan.nr, SKULL_KV_SCAN_MAX);
+    // the walk runs under rcu, so the records go to userspace once it's over
+    recs = kvmalloc_array(max_t(u32, scan.nr, 1), sizeof(struct skull_kv_rec), GFP_KERNEL);
+    if (!recs) return -ENOMEM;
+    rhashtable_walk_enter(&dev->kv, &iter);
+    rhashtable_walk_start(&iter);
+    while (n < scan.nr && (e = rhashtable_walk_next(&iter))) {
+        if (IS_ERR(e)) {
+            // a resize sends the walk back to the start
+            seen = n = 0;
+            continue;
+        }
+        if (e->key.len < scan.prefixLen || memcmp(e->key.data, scan.prefix, scan.prefixLen)) continue;
+        if (seen++ < scan.pos) continue;
+        recs[n].keyLen = e->key.len;
+        recs[n].valLen = e->val->size;
+        memcpy(recs[n].key, e->key.data, SKULL_KV_KEY_MAX);
+        n++;
+    }
+    rhashtable_walk_stop(&iter);
+    rhashtable_walk_exit(&iter);
 
-    default: /* can't happen */
-        return -EINVAL;
+    if (copy_to_user(u64_to_user_ptr(scan.recs), recs, n * sizeof(struct skull_kv_rec)) ||
+        put_user(n, &arg->nr) || put_user(scan.pos + n, &arg->pos)) {
+        err = -EFAULT;
     }
-    if (newpos < 0) return -EINVAL;
-    filp->f_pos = newpos;
-    return newpos;
+    kvfree(recs);
+    return err;
 }
 
+// the ioctls that set what skull0 gets at its next trim
+static bool next_trim_ioctl(unsigned int cmd) {
+    switch (cmd) {
+    case SKULL_IOC_RESET:
+    case SKULL_IOC_SET_QUANTUM:
+    case SKULL_IOC_SET_QSET:
+    case SKULL_IOC_TELL_QUANTUM:
+    case SKULL_IOC_TELL_QSET:
+    case SKULL_IOC_EXCHANGE_QUANTUM:
+    case SKULL_IOC_EXCHANGE_QSET:
+    case SKULL_IOC_SHIFT_QUANTUM:
+    case SKULL_IOC_SHIFT_QSET:
+    case SKULL_IOC_SET_ENGINE:
+        return true;
+    }
+    return false;
+}
 
 static long ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
+    struct skull_file* sfile = filp->private_data;
+    struct skull_ring_window window;
     unsigned int dir;
     int err = 0, tmp;
     int result = 0;
@@ -239,11 +1973,14 @@ static long ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
         err = !access_ok((void __user*)arg, _IOC_SIZE(cmd));
     }
     if (err) return -EFAULT;
+    // a private instance is never trimmed, so these would only change skull0 behind its back
+    if (sfile->dev->priv && next_trim_ioctl(cmd)) return -EINVAL;
 
     switch (cmd) {
     case SKULL_IOC_RESET: /* set the default valuees */
         quantum_size = QUANTUM_SIZE;
         qset_size = Q_SET_SIZE;
+        engine_kind = engine;
         break;
     case SKULL_IOC_SET_QUANTUM: /* set variable from pointer */
         if (!capable(CAP_SYS_ADMIN)) return -EPERM;
@@ -297,20 +2034,780 @@ static long ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
         tmp = qset_size;
         qset_size = arg;
         return tmp;
+    case SKULL_IOC_WCOMBINE: /* arg is the staging buffer size for this open, 0 turns it off */
+        return wc_resize(sfile, arg);
+    case SKULL_IOC_FLUSH: /* commit the staged writes of this open */
+        return wc_sync(sfile);
+    case SKULL_IOC_SET_ENGINE: /* the arg is the engine, used after the next trim */
+        if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+        if (arg != SKULL_ENGINE_QSET && arg != SKULL_ENGINE_EXTENT && arg != SKULL_ENGINE_RING) return -EINVAL;
+        // the ring is allocated now, so the trim that switches to it can't fail
+        if (arg == SKULL_ENGINE_RING && ring_prepare(sfile->dev)) return -ENOMEM;
+        engine_kind = arg;
+        break;
+    case SKULL_IOC_RING_WINDOW: /* the sequence numbers still in the ring */
+        if (READ_ONCE(sfile->dev->engine) != SKULL_ENGINE_RING) return -EINVAL;
+        ring_window(sfile->dev, &window.head, &window.tail);
+        window.capacity = sfile->dev->ringCap;
+        return copy_to_user((void __user*)arg, &window, sizeof(window)) ? -EFAULT : 0;
+    case SKULL_IOC_QUERY_ENGINE:
+        return engine_kind;
+    case SKULL_IOC_FOLLOW: /* arg 1 makes reads at the end wait for more data, 0 goes back to EOF */
+        WRITE_ONCE(sfile->follow, !!arg);
+        // sleeping followers of this file have to notice it was turned off
+        if (!arg) wake_up_interruptible_all(&sfile->dev->readq);
+        break;
+    case SKULL_IOC_COPY_RANGE: /* copy from another open skull file into this one */
+    case SKULL_IOC_CLONE_RANGE: /* same, but sharing the quanta */
+        return range_ioctl(filp, cmd, arg);
+    case SKULL_IOC_KV_GET: /* value of a key, -ENOENT if there is none */
+        return kv_get(sfile->dev, (struct skull_kv __user*)arg);
+    case SKULL_IOC_KV_PUT: /* adds the key or replaces its value */
+        if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+        return kv_put(sfile->dev, (struct skull_kv __user*)arg);
+    case SKULL_IOC_KV_DELETE:
+        if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+        return kv_delete(sfile->dev, (struct skull_kv __user*)arg);
+    case SKULL_IOC_KV_SCAN: /* the next batch of keys, optionally only those with a prefix */
+        return kv_scan(sfile->dev, (struct skull_kv_scan __user*)arg);
+    case SKULL_IOC_VERIFY: /* checks the sums of a range, needs the checksum module parameter */
+        return verify_range(sfile->dev, (struct skull_verify __user*)arg);
     default:
         return -ENOTTY;
     }
     return result;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+/*
+ * io_uring passthrough. Queries are answered inline, batches of positioned reads and
+ * writes reuse the same read and write callbacks. Those can sleep on the lock, so when
+ * io_uring asks us not to block we return -EAGAIN and it runs the command again from
+ * one of its workers, completing asynchronously.
+ */
+static void uring_payload(struct io_uring_cmd* ioucmd, struct skull_uring_cmd* payload) {
+    const struct skull_uring_cmd* sqeCmd;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    sqeCmd = io_uring_sqe_cmd(ioucmd->sqe);
+#else
+    sqeCmd = ioucmd->cmd;
+#endif
+    // the sqe is shared with userspace, read every field only once
+    payload->addr = READ_ONCE(sqeCmd->addr);
+    payload->nr = READ_ONCE(sqeCmd->nr);
+    payload->flags = READ_ONCE(sqeCmd->flags);
+}
+
+static ssize_t uring_rw_one(struct file* filp, struct skull_rw* rw) {
+    loff_t pos = rw->off;
+    size_t done = 0;
+    ssize_t n;
+
+    if (rw->op == SKULL_RW_READ && !(filp->f_mode & FMODE_READ)) return -EBADF;
+    if (rw->op == SKULL_RW_WRITE && !(filp->f_mode & FMODE_WRITE)) return -EBADF;
+    // reads go around read(), so a file in follow mode still gets its EOF instead of
+    // leaving an io-wq worker asleep on one entry of the batch
+    if (rw->op == SKULL_RW_READ) {
+        n = wc_sync(filp->private_data);
+        if (n) return n;
+    }
+    // skull stops at the end of every quantum, so we loop until the request is done
+    while (done < rw->len) {
+        if (rw->op == SKULL_RW_READ) {
+            n = read_once(filp->private_data, u64_to_user_ptr(rw->buf + done), rw->len - done, &pos);
+        }
+        else if (rw->op == SKULL_RW_WRITE) {
+            n = write(filp, u64_to_user_ptr(rw->buf + done), rw->len - done, &pos);
+        }
+        else {
+            return -EINVAL;
+        }
+        if (n < 0) return done ? done : n;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+static int uring_rw_batch(struct file* filp, struct skull_uring_cmd* payload) {
+    struct skull_rw __user* entries = u64_to_user_ptr(payload->addr);
+    struct skull_rw rw;
+    __u32 i;
+
+    if (payload->nr > SKULL_URING_MAX_BATCH) return -E2BIG;
+    for (i = 0; i < payload->nr; i++) {
+        if (copy_from_user(&rw, &entries[i], sizeof(rw))) return i ? i : -EFAULT;
+        rw.result = uring_rw_one(filp, &rw);
+        if (put_user(rw.result, &entries[i].result)) return i ? i : -EFAULT;
+        if (fatal_signal_pending(current)) return i + 1;
+        cond_resched();
+    }
+    return payload->nr;
+}
+
+static int uring_cmd(struct io_uring_cmd* ioucmd, unsigned int issue_flags) {
+    struct skull_file* sfile = ioucmd->file->private_data;
+    struct skull_d* dev = sfile->dev;
+    struct skull_uring_cmd payload;
+    struct skull_stats stats;
+
+    uring_payload(ioucmd, &payload);
+    if (payload.flags) return -EINVAL;
+
+    switch (ioucmd->cmd_op) {
+    case SKULL_URING_QUERY_QUANTUM:
+        return quantum_size;
+    case SKULL_URING_QUERY_QSET:
+        return qset_size;
+    case SKULL_URING_STATS:
+        memset(&stats, 0, sizeof(stats));
+        stats.size = READ_ONCE(dev->size);
+        stats.generation = READ_ONCE(dev->generation);
+        stats.quantum = READ_ONCE(dev->quantum);
+        stats.qset = READ_ONCE(dev->qset);
+        stats.nextQuantum = quantum_size;
+        stats.nextQset = qset_size;
+        if (copy_to_user(u64_to_user_ptr(payload.addr), &stats, sizeof(stats))) return -EFAULT;
+        return 0;
+    case SKULL_URING_RW:
+        if (issue_flags & IO_URING_F_NONBLOCK) return -EAGAIN;
+        return uring_rw_batch(ioucmd->file, &payload);
+    default:
+        return -ENOTTY;
+    }
+}
+#endif
+
+static int blk_mb;
+module_param(blk_mb, int, 0444);
+MODULE_PARM_DESC(blk_mb, "size in MB of the /dev/skullb block device, 0 (the default) for none");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+/*
+ * Block device frontend: a RAM disk on a quantum store of its own, so a trim of
+ * skull0 can't pull the data from under a mounted filesystem. Every cpu gets a hardware
+ * queue and requests go straight to the quanta, one bio_vec at a time, pinning them like
+ * the char device does and copying without the lock. The lock is a mutex, so the
+ * queues are blocking ones.
+ */
+#define SKULL_BLK_QUANTUM PAGE_SIZE /* a page per quantum, so a page sized io is one lookup */
+#define SKULL_BLK_QSET 1024
+#define SKULL_BLK_DEPTH 128
+
+static struct skull_blk {
+    struct skull_d dev;
+    struct blk_mq_tag_set tags;
+    struct gendisk* disk;
+    struct skull_cursor* cursors; /* one per hardware queue */
+    int major;
+} blk;
+
+/*
+ * Pins the quantum a write lands in, like dev_write_pin but without its logging and
+ * engine checks: the disk is always quanta and its size is the capacity from the start.
+ */
+static int blk_write_pin(struct skull_d* dev, struct skull_cursor* cursor, loff_t off, size_t* len,
+    struct quantum** pinned, size_t* pinnedOff) {
+    struct prealloc pre = { .want = *len };
+    struct quantum* q;
+    size_t qOff, avail;
+    u64 lockedAt;
+
+    for (;;) {
+        lock_dev(dev, SKULL_FOP_WRITE, &lockedAt, false);
+        q = quantumAt(dev, cursor, off, &qOff, &avail, &pre);
+        if (q) break;
+        unlock_dev(dev, SKULL_FOP_WRITE, lockedAt);
+        if (prealloc_fill(&pre, SKULL_BLK_QUANTUM, SKULL_BLK_QSET)) {
+            prealloc_release(&pre);
+            return -ENOMEM;
+        }
+    }
+    refcount_inc(&q->ref);
+    unlock_dev(dev, SKULL_FOP_WRITE, lockedAt);
+    prealloc_release(&pre);
+    *len = min(*len, avail);
+    *pinned = q;
+    *pinnedOff = qOff;
+    return 0;
+}
+
+static int blk_segment(struct skull_d* dev, struct skull_cursor* cursor, struct bio_vec* bv, loff_t off, bool isWrite) {
+    struct quantum* q;
+    size_t done = 0, len, qOff, avail;
+    u64 lockedAt;
+    int err;
+
+    while (done < bv->bv_len) {
+        len = bv->bv_len - done;
+        if (isWrite) {
+            err = blk_write_pin(dev, cursor, off + done, &len, &q, &qOff);
+            if (err) return err;
+            quantum_write_begin(q);
+            memcpy_from_page(q->data + qOff, bv->bv_page, bv->bv_offset + done, len);
+            quantum_write_end(q);
+        }
+        else {
+            lock_dev(dev, SKULL_FOP_READ, &lockedAt, false);
+            q = quantumAt(dev, cursor, off + done, &qOff, &avail, NULL);
+            if (q) refcount_inc(&q->ref);
+            unlock_dev(dev, SKULL_FOP_READ, lockedAt);
+            // avail is set for holes too, they read as zeros up to the next quantum
+            len = min(len, avail);
+            if (q) {
+                memcpy_to_page(bv->bv_page, bv->bv_offset + done, q->data + qOff, len);
+            }
+            else {
+                memzero_page(bv->bv_page, bv->bv_offset + done, len);
+            }
+        }
+        quantum_put(q);
+        done += len;
+    }
+    return 0;
+}
+
+static blk_status_t blk_queue_rq(struct blk_mq_hw_ctx* hctx, const struct blk_mq_queue_data* bd) {
+    struct request* rq = bd->rq;
+    struct skull_d* dev = hctx->queue->queuedata;
+    struct req_iterator iter;
+    struct bio_vec bv;
+    loff_t off = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    blk_status_t status = BLK_STS_OK;
+    unsigned int noio;
+    int err;
+
+    blk_mq_start_request(rq);
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        break;
+    case REQ_OP_FLUSH: /* it's all in memory already */
+        goto out;
+    default:
+        status = BLK_STS_NOTSUPP;
+        goto out;
+    }
+    // allocating a quantum must not start io, it could end up waiting for this very request
+    noio = memalloc_noio_save();
+    rq_for_each_segment(bv, rq, iter) {
+        err = blk_segment(dev, hctx->driver_data, &bv, off, op_is_write(req_op(rq)));
+        if (err) {
+            status = errno_to_blk_status(err);
+            break;
+        }
+        off += bv.bv_len;
+    }
+    memalloc_noio_restore(noio);
+out:
+    blk_mq_end_request(rq, status);
+    return BLK_STS_OK;
+}
+
+static int blk_init_hctx(struct blk_mq_hw_ctx* hctx, void* data, unsigned int idx) {
+    hctx->driver_data = &blk.cursors[idx];
+    return 0;
+}
+
+static const struct blk_mq_ops blk_mq_ops = {
+  .queue_rq = blk_queue_rq,
+  .init_hctx = blk_init_hctx,
+};
+
+static const struct block_device_operations blk_fops = {
+  .owner = THIS_MODULE,
+};
+
+static void blk_put_disk(struct gendisk* disk) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    put_disk(disk);
+#else
+    blk_cleanup_disk(disk);
+#endif
+}
+
+static int blk_create(void) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    struct queue_limits lim = { .logical_block_size = SECTOR_SIZE, .physical_block_size = PAGE_SIZE };
+#endif
+    int err;
+
+    if (blk_mb <= 0) return 0;
+    err = skull_dev_init(&blk.dev);
+    if (err) return err;
+    // the disk never changes engine or geometry, it is never trimmed
+    blk.dev.blk = true;
+    blk.dev.engine = SKULL_ENGINE_QSET;
+    skull_geometry(&blk.dev, SKULL_BLK_QUANTUM, SKULL_BLK_QSET);
+    blk.dev.size = (u64)blk_mb << 20;
+    // writeback is what needs the reserve most, so its quanta get a pool of their size
+    err = reserve_init(&blkReserve, SKULL_BLK_QUANTUM);
+    if (err) goto free_dev;
+    err = -ENOMEM;
+    blk.cursors = kcalloc(nr_cpu_ids, sizeof(struct skull_cursor), GFP_KERNEL);
+    if (!blk.cursors) goto free_dev;
+
+    blk.tags.ops = &blk_mq_ops;
+    blk.tags.nr_hw_queues = nr_cpu_ids;
+    blk.tags.queue_depth = SKULL_BLK_DEPTH;
+    blk.tags.numa_node = NUMA_NO_NODE;
+    blk.tags.flags = BLK_MQ_F_BLOCKING;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+    blk.tags.flags |= BLK_MQ_F_SHOULD_MERGE;
+#endif
+    err = blk_mq_alloc_tag_set(&blk.tags);
+    if (err) goto free_cursors;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    blk.disk = blk_mq_alloc_disk(&blk.tags, &lim, &blk.dev);
+#else
+    blk.disk = blk_mq_alloc_disk(&blk.tags, &blk.dev);
+#endif
+    if (IS_ERR(blk.disk)) {
+        err = PTR_ERR(blk.disk);
+        goto free_tags;
+    }
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+    blk_queue_logical_block_size(blk.disk->queue, SECTOR_SIZE);
+    blk_queue_physical_block_size(blk.disk->queue, PAGE_SIZE);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+    blk_queue_flag_set(QUEUE_FLAG_NONROT, blk.disk->queue);
+#endif
+
+    blk.major = register_blkdev(0, SKULL "b");
+    if (blk.major < 0) {
+        err = blk.major;
+        goto free_disk;
+    }
+    blk.disk->major = blk.major;
+    blk.disk->first_minor = 0;
+    blk.disk->minors = 1;
+    blk.disk->fops = &blk_fops;
+    snprintf(blk.disk->disk_name, DISK_NAME_LEN, SKULL "b");
+    set_capacity(blk.disk, (sector_t)blk_mb << (20 - SECTOR_SHIFT));
+    err = add_disk(blk.disk);
+    if (err) goto unregister;
+    pr_alert("%s - block device %s ready, %d MB on %u queues\n", PREF, blk.disk->disk_name, blk_mb, nr_cpu_ids);
+    return 0;
+
+unregister:
+    unregister_blkdev(blk.major, SKULL "b");
+free_disk:
+    blk_put_disk(blk.disk);
+free_tags:
+    blk_mq_free_tag_set(&blk.tags);
+free_cursors:
+    kfree(blk.cursors);
+free_dev:
+    reserve_destroy(&blkReserve);
+    rhashtable_destroy(&blk.dev.kv);
+    blk.disk = NULL;
+    return err;
+}
+
+static void blk_destroy(void) {
+    if (!blk.disk) return;
+    del_gendisk(blk.disk);
+    blk_put_disk(blk.disk);
+    blk_mq_free_tag_set(&blk.tags);
+    unregister_blkdev(blk.major, SKULL "b");
+    kfree(blk.cursors);
+    skull_trim(&blk.dev);
+    rhashtable_destroy(&blk.dev.kv);
+    reserve_destroy(&blkReserve);
+}
+#else
+static int blk_create(void) {
+    if (blk_mb > 0) pr_alert("%s - the block device needs a 5.15 kernel or newer, skipping it\n", PREF);
+    return 0;
+}
+
+static void blk_destroy(void) {
+}
+#endif
+
+#if IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+/*
+ * Open coded BPF iterator over the populated chunks of a device, for sleepable syscall
+ * programs. bpf_iter_reg_target is not available to modules, kfuncs are:
+ *
+ *     bpf_for_each(skull, chunk, fd) {
+ *         n = bpf_skull_chunk_read(chunk, 0, buf, sizeof(buf));
+ *         ...
+ *     }
+ *
+ * Each step takes the device lock once and pins the chunk, the program reads it without
+ * the lock, so a scan costs one kfunc call per chunk instead of a read syscall.
+ */
+struct skull_chunk {
+    u64 off;                /* where the chunk starts in the device */
+    u32 len;
+    u32 qOff;               /* where it starts in q */
+    struct quantum* q;
+};
+
+/* what the program sees is only the right amount of opaque space */
+struct bpf_iter_skull {
+    u64 __opaque[7];
+} __aligned(8);
+
+struct bpf_iter_skull_kern {
+    struct file* file;
+    struct skull_cursor cursor;
+    struct skull_chunk chunk;
+} __aligned(8);
+
+__bpf_kfunc_start_defs();
+
+__bpf_kfunc int bpf_iter_skull_new(struct bpf_iter_skull* it, int fd) {
+    struct bpf_iter_skull_kern* kit = (void*)it;
+
+    BUILD_BUG_ON(sizeof(struct bpf_iter_skull_kern) > sizeof(struct bpf_iter_skull));
+    BUILD_BUG_ON(__alignof__(struct bpf_iter_skull_kern) != __alignof__(struct bpf_iter_skull));
+    memset(kit, 0, sizeof(*kit));
+    kit->file = fget(fd);
+    if (!kit->file) return -EBADF;
+    if (kit->file->f_op != &fops || !(kit->file->f_mode & FMODE_READ)) {
+        fput(kit->file);
+        kit->file = NULL;
+        return -EBADF;
+    }
+    return 0;
+}
+
+__bpf_kfunc struct skull_chunk* bpf_iter_skull_next(struct bpf_iter_skull* it) {
+    struct bpf_iter_skull_kern* kit = (void*)it;
+    struct skull_d* dev;
+    u64 lockedAt, pos;
+
+    if (!kit->file) return NULL;
+    dev = ((struct skull_file*)kit->file->private_data)->dev;
+    pos = kit->chunk.off + kit->chunk.len;
+    quantum_put(kit->chunk.q);
+    kit->chunk.q = NULL;
+    lock_dev(dev, SKULL_FOP_READ, &lockedAt, false);
+    kit->chunk.q = nextPopulated(dev, &kit->cursor, &pos, &kit->chunk.len, &kit->chunk.qOff);
+    unlock_dev(dev, SKULL_FOP_READ, lockedAt);
+    kit->chunk.off = pos;
+    return kit->chunk.q ? &kit->chunk : NULL;
+}
+
+__bpf_kfunc void bpf_iter_skull_destroy(struct bpf_iter_skull* it) {
+    struct bpf_iter_skull_kern* kit = (void*)it;
+
+    quantum_put(kit->chunk.q);
+    kit->chunk.q = NULL;
+    if (kit->file) fput(kit->file);
+    kit->file = NULL;
+}
+
+// copies up to dst__sz bytes of the chunk starting at off, returns how many
+__bpf_kfunc int bpf_skull_chunk_read(struct skull_chunk* chunk, u32 off, void* dst, u32 dst__sz) {
+    u32 len;
+
+    if (!chunk->q || off >= chunk->len) return 0;
+    len = min(dst__sz, chunk->len - off);
+    memcpy(dst, chunk->q->data + chunk->qOff + off, len);
+    return len;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(skull_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_iter_skull_new, KF_ITER_NEW | KF_SLEEPABLE)
+BTF_ID_FLAGS(func, bpf_iter_skull_next, KF_ITER_NEXT | KF_RET_NULL | KF_SLEEPABLE)
+BTF_ID_FLAGS(func, bpf_iter_skull_destroy, KF_ITER_DESTROY | KF_SLEEPABLE)
+BTF_ID_FLAGS(func, bpf_skull_chunk_read, KF_TRUSTED_ARGS)
+BTF_KFUNCS_END(skull_kfunc_ids)
+
+static const struct btf_kfunc_id_set skull_kfunc_set = {
+  .owner = THIS_MODULE,
+  .set = &skull_kfunc_ids,
+};
+
+static void bpf_iter_register(void) {
+    // not fatal, the device works the same without it
+    if (register_btf_kfunc_id_set(BPF_PROG_TYPE_SYSCALL, &skull_kfunc_set)) {
+        pr_alert("%s - could not register the bpf iterator, running without it\n", PREF);
+    }
+}
+#else
+static void bpf_iter_register(void) {
+}
+#endif
+
+static int reserve_show(struct seq_file* s, void* unused) {
+    struct reserve* r;
+    int i;
+    seq_printf(s, "%-8s %8s %6s %6s %12s %12s %12s\n", "pool", "size", "min", "free", "hits", "misses", "other_size");
+    for (i = 0; i < ARRAY_SIZE(reserves); i++) {
+        r = reserves[i];
+        seq_printf(s, "%-8s %8zu %6d %6d %12lld %12lld %12lld\n", r->name, r->size,
+            r->pool ? r->pool->min_nr : 0, r->pool ? READ_ONCE(r->pool->curr_nr) : 0,
+            atomic64_read(&r->hits), atomic64_read(&r->misses), atomic64_read(&r->other));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(reserve);
+
+/*
+ * skull/layout: how the memory of skull0 is laid out, one line per node (or per extent)
+ * and the totals at the end. seq_file calls start and stop around every page of output,
+ * so the lock is held for one page worth of lines at a time, and the cursor kept between
+ * calls lets each page continue where the last one stopped without walking the list again.
+ */
+#define LAYOUT_TOTALS ((void*)2)
+
+struct layout_iter {
+    struct skull_cursor cursor;
+    struct skull_extent* ext;   /* last extent shown, valid while the generation holds */
+    loff_t extPos;
+    unsigned long extGen;
+    u64 lockedAt;
+    loff_t pos;                 /* record being shown, the header is 0 */
+    loff_t counted;             /* records already in the totals, one shown twice counts once */
+    u64 nodes, arrays, quanta, shared, data, waste, memory;
+};
+
+static void* layout_at(struct layout_iter* it, loff_t pos) {
+    struct skull_d* dev = &skull;
+    struct rb_node* rb;
+    struct node* node;
+    u64 count;
+
+    it->pos = pos;
+    if (pos == 0) return SEQ_START_TOKEN;
+    if (dev->engine == SKULL_ENGINE_EXTENT) {
+        // extents are only freed by a trim, so the last one is a safe place to go on from
+        if (it->ext && it->extGen == dev->generation && it->extPos == pos - 1) {
+            rb = rb_next(&it->ext->rb);
+            count = pos - 1;
+        }
+        else {
+            for (rb = rb_first(&dev->extents), count = 1; rb && count < pos; count++) rb = rb_next(rb);
+            count--;
+        }
+        if (rb) {
+            it->ext = rb_entry(rb, struct skull_extent, rb);
+            it->extPos = pos;
+            it->extGen = dev->generation;
+            return it->ext;
+        }
+        // count is how many extents there are, the totals come right after the last
+        it->ext = NULL;
+        return pos == count + 1 ? LAYOUT_TOTALS : NULL;
+    }
+    if (dev->engine != SKULL_ENGINE_QSET || dev->small) {
+        return pos == 1 ? LAYOUT_TOTALS : NULL;
+    }
+    node = getNodeByIndex(dev, &it->cursor, pos - 1, NULL);
+    if (node) return node;
+    // the cursor stopped on the last node
+    count = dev->data ? it->cursor.index + 1 : 0;
+    return pos == count + 1 ? LAYOUT_TOTALS : NULL;
+}
+
+static void* layout_start(struct seq_file* s, loff_t* pos) {
+    struct layout_iter* it = s->private;
+    lock_dev(&skull, SKULL_FOP_READ, &it->lockedAt, false);
+    return layout_at(it, *pos);
+}
+
+static void* layout_next(struct seq_file* s, void* v, loff_t* pos) {
+    ++*pos;
+    return v == LAYOUT_TOTALS ? NULL : layout_at(s->private, *pos);
+}
+
+static void layout_stop(struct seq_file* s, void* v) {
+    struct layout_iter* it = s->private;
+    unlock_dev(&skull, SKULL_FOP_READ, it->lockedAt);
+}
+
+static void layout_node(struct seq_file* s, struct layout_iter* it, struct node* node) {
+    struct skull_d* dev = &skull;
+    u64 start, data = 0, waste = 0, memory = sizeof(struct node);
+    int slot, quanta = 0, shared = 0;
+    struct quantum* q;
+
+    start = (u64)(it->pos - 1) * dev->quantum * dev->qset;
+    for (slot = 0; node->data && slot < dev->qset; slot++, start += dev->quantum) {
+        q = node->data[slot];
+        if (!q) continue;
+        quanta++;
+        if (atomic_read(&q->owners) > 1) shared++;
+        memory += quantum_memory(q);
+        // whatever lies past the end of the device is allocated for nothing
+        if (start >= dev->size) waste += q->size;
+        else if (dev->size - start < q->size) waste += q->size - (dev->size - start);
+        data += q->size;
+    }
+    data -= waste;
+    if (node->data) memory += dev->qset * sizeof(struct quantum*);
+    seq_printf(s, "%-12lld %5s %8d %8d %12llu %12llu %12llu\n", it->pos - 1, node->data ? "yes" : "no",
+        quanta, shared, data, waste, memory);
+    if (it->pos > it->counted) {
+        it->counted = it->pos;
+        it->nodes++;
+        it->arrays += node->data != NULL;
+        it->quanta += quanta;
+        it->shared += shared;
+        it->data += data;
+        it->waste += waste;
+        it->memory += memory;
+    }
+}
+
+static void layout_extent(struct seq_file* s, struct layout_iter* it, struct skull_extent* e) {
+    u64 memory = sizeof(struct skull_extent) + quantum_memory(e->q);
+    u64 waste = e->q->size - e->len;
+    seq_printf(s, "%-12lld %12lld %12zu %12u %12llu\n", it->pos - 1, (long long)e->start, e->len, e->q->size, memory);
+    if (it->pos > it->counted) {
+        it->counted = it->pos;
+        it->nodes++;
+        it->quanta++;
+        it->shared += atomic_read(&e->q->owners) > 1;
+        it->data += e->len;
+        it->waste += waste;
+        it->memory += memory;
+    }
+}
+
+static int layout_show(struct seq_file* s, void* v) {
+    struct layout_iter* it = s->private;
+    struct skull_d* dev = &skull;
+
+    if (v == SEQ_START_TOKEN) {
+        seq_printf(s, "engine %d quantum %d qset %d size %llu generation %lu\n", dev->engine, dev->quantum,
+            dev->qset, dev->size, dev->generation);
+        if (dev->engine == SKULL_ENGINE_EXTENT) {
+            seq_printf(s, "%-12s %12s %12s %12s %12s\n", "extent", "start", "len", "capacity", "memory");
+        }
+        else if (dev->engine == SKULL_ENGINE_QSET && !dev->small) {
+            seq_printf(s, "%-12s %5s %8s %8s %12s %12s %12s\n", "node", "array", "quanta", "shared", "data", "waste", "memory");
+        }
+        return 0;
+    }
+    if (v == LAYOUT_TOTALS) {
+        if (dev->engine == SKULL_ENGINE_RING) {
+            seq_printf(s, "ring %zu bytes, head %llu\n", dev->ringCap, dev->ringHead);
+        }
+        else if (dev->small) {
+            seq_printf(s, "inline %u bytes\n", dev->small->size);
+        }
+        else {
+            seq_printf(s, "total nodes %llu arrays %llu quanta %llu shared %llu data %llu waste %llu memory %llu\n",
+                it->nodes, it->arrays, it->quanta, it->shared, it->data, it->waste, it->memory);
+        }
+        return 0;
+    }
+    if (dev->engine == SKULL_ENGINE_EXTENT) {
+        layout_extent(s, it, v);
+    }
+    else {
+        layout_node(s, it, v);
+    }
+    return 0;
+}
+
+static const struct seq_operations layout_seq_ops = {
+  .start = layout_start,
+  .next = layout_next,
+  .stop = layout_stop,
+  .show = layout_show,
+};
+
+static int layout_open(struct inode* inode, struct file* filp) {
+    return seq_open_private(filp, &layout_seq_ops, sizeof(struct layout_iter));
+}
+
+static const struct file_operations layout_fops = {
+  .owner = THIS_MODULE,
+  .open = layout_open,
+  .read = seq_read,
+  .llseek = seq_lseek,
+  .release = seq_release_private,
+};
+
+static int timed_open(struct inode* inode, struct file* filp) {
+    int result;
+    u64 start, end;
+    if (!fopHist && !capturing) return open(inode, filp);
+    start = ktime_get_ns();
+    result = open(inode, filp);
+    end = fop_latency_add(SKULL_FOP_OPEN, start);
+    trace_add(TRACE_OPEN, filp, 0, filp->f_flags, result, start, end);
+    return result;
+}
+
+static ssize_t timed_read(struct file* filp, char __user* buf, size_t len, loff_t* off) {
+    ssize_t result;
+    loff_t pos = *off;
+    u64 start, end;
+    if (!fopHist && !capturing) return read(filp, buf, len, off);
+    start = ktime_get_ns();
+    result = read(filp, buf, len, off);
+    end = fop_latency_add(SKULL_FOP_READ, start);
+    trace_add(TRACE_READ, filp, pos, len, result, start, end);
+    return result;
+}
+
+static ssize_t timed_write(struct file* filp, const char __user* buf, size_t len, loff_t* off) {
+    ssize_t result;
+    loff_t pos = *off;
+    u64 start, end;
+    if (!fopHist && !capturing) return write(filp, buf, len, off);
+    start = ktime_get_ns();
+    result = write(filp, buf, len, off);
+    end = fop_latency_add(SKULL_FOP_WRITE, start);
+    trace_add(TRACE_WRITE, filp, pos, len, result, start, end);
+    return result;
+}
+
+static long timed_ioctl(struct file* filp, unsigned int cmd, unsigned long arg) {
+    long result;
+    u64 start;
+    if (!fopHist) return ioctl(filp, cmd, arg);
+    start = ktime_get_ns();
+    result = ioctl(filp, cmd, arg);
+    fop_latency_add(SKULL_FOP_IOCTL, start);
+    return result;
+}
+
+static unsigned int timed_poll(struct file* filp, poll_table* wait) {
+    unsigned int mask;
+    u64 start;
+    if (!fopHist) return poll(filp, wait);
+    start = ktime_get_ns();
+    mask = poll(filp, wait);
+    fop_latency_add(SKULL_FOP_POLL, start);
+    return mask;
+}
+
+static int timed_release(struct inode* inode, struct file* filp) {
+    int result;
+    u64 start, end;
+    if (!fopHist && !capturing) return release(inode, filp);
+    start = ktime_get_ns();
+    result = release(inode, filp);
+    end = fop_latency_add(SKULL_FOP_RELEASE, start);
+    trace_add(TRACE_RELEASE, filp, 0, 0, result, start, end);
+    return result;
+}
+
 static const struct file_operations fops = {
   .owner = THIS_MODULE,
-  .open = open,
-  .read = read,
-  .write = write,
-  .release = release,
+  .open = timed_open,
+  .read = timed_read,
+  .write = timed_write,
+  .release = timed_release,
   .llseek = llseek,
-  .unlocked_ioctl = ioctl,
+  .fsync = fsync,
+  .poll = timed_poll,
+  .unlocked_ioctl = timed_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+  .uring_cmd = uring_cmd,
+#endif
 };
 
 
@@ -328,19 +2825,72 @@ static int init_skull(void) {
 
     skull.skull_cdev.owner = THIS_MODULE;
     skull.skull_cdev.ops = &fops;
-    mutex_init(&skull.lock);
+    cdev_init(&privCdev, &fops);
+    privCdev.owner = THIS_MODULE;
+    if (ring_size <= 0) ring_size = 1 << 20;
+    if (engine != SKULL_ENGINE_QSET && engine != SKULL_ENGINE_EXTENT && engine != SKULL_ENGINE_RING) {
+        pr_alert("%s - unknown engine %d, using quanta\n", PREF, engine);
+        engine = SKULL_ENGINE_QSET;
+    }
+    engine_kind = engine;
+    err = skull_dev_init(&skull);
+    if (err != 0) {
+        goto remove_region;
+    }
+    if (engine == SKULL_ENGINE_RING && ring_prepare(&skull)) {
+        pr_alert("%s - no memory for the ring, using quanta\n", PREF);
+        engine_kind = skull.engine = engine = SKULL_ENGINE_QSET;
+    }
+
+    // the reserve has to be there before anybody can write
+    quantumCache = kmem_cache_create("skull_quantum", quantum_header_bytes(), 0, 0, NULL);
+    headerReserve.cache = quantumCache;
+    err = quantumCache ? 0 : -ENOMEM;
+    if (!err) err = reserve_init(&nodeReserve, sizeof(struct node));
+    if (!err) err = reserve_init(&arrayReserve, qset_size * sizeof(struct quantum*));
+    if (!err) err = reserve_init(&headerReserve, quantum_header_bytes());
+    if (!err) err = reserve_init(&quantumReserve, quantum_size);
+    if (err != 0) {
+        goto remove_reserve;
+    }
 
     err = cdev_add(&skull.skull_cdev, devNum, 1);
     if (err != 0) {
-        goto remove_cdev;
+        goto remove_reserve;
+    }
+    err = cdev_add(&privCdev, MKDEV(MAJOR(devNum), MINOR(devNum) + 1), 1);
+    if (err != 0) {
+        goto remove_reserve;
     }
+    err = blk_create();
+    if (err != 0) {
+        goto remove_reserve;
+    }
+    bpf_iter_register();
     pr_alert("%s - Character device ready to use\n", PREF);
 
+    // debugfs is only for inspection, we keep going even if it fails
+    debugDir = debugfs_create_dir(SKULL, NULL);
+    lock_stats_init(debugDir);
+    debugfs_create_file("reserve", 0444, debugDir, NULL, &reserve_fops);
+    debugfs_create_file("layout", 0444, debugDir, NULL, &layout_fops);
+    fop_latency_init(debugDir, PREF);
+    BUILD_BUG_ON(sizeof(struct trace_rec) != sizeof(struct skull_trace_rec));
+    fop_capture_init(debugDir, PREF);
 
     return 0;
 
-remove_cdev:
+remove_reserve:
+    reserve_destroy(&quantumReserve);
+    reserve_destroy(&headerReserve);
+    reserve_destroy(&arrayReserve);
+    reserve_destroy(&nodeReserve);
+    kmem_cache_destroy(quantumCache);
+    vfree(skull.ring);
+    rhashtable_destroy(&skull.kv);
+    cdev_del(&privCdev);
     cdev_del(&skull.skull_cdev);
+remove_region:
     unregister_chrdev_region(devNum, count);
 error:
     pr_alert("%s - THIS IS NO GOOD, ERROR\n", PREF);
@@ -348,8 +2898,22 @@ error:
 }
 
 static void exit_skull(void) {
-    skull_trim(&skull);
+    debugfs_remove_recursive(debugDir);
+    free_percpu(fopHist);
+    kvfree(traceBuf);
+    blk_destroy();
+    cdev_del(&privCdev);
     cdev_del(&skull.skull_cdev);
+    skull_trim(&skull);
+    rhashtable_free_and_destroy(&skull.kv, kv_entry_free_now, NULL);
+    vfree(skull.ring);
+    // the values of deleted entries are still waiting for rcu, and they go back to the reserve
+    rcu_barrier();
+    reserve_destroy(&quantumReserve);
+    reserve_destroy(&headerReserve);
+    reserve_destroy(&arrayReserve);
+    reserve_destroy(&nodeReserve);
+    kmem_cache_destroy(quantumCache);
     pr_alert("%s - Character device struct deallocated!\n", PREF);
     unregister_chrdev_region(devNum, count);
     pr_alert("%s - Char region deallocated\n", PREF);
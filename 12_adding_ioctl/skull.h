@@ -1,6 +1,12 @@
 #include <linux/ioctl.h>
 #include <linux/cdev.h>
 #include <linux/mutex.h>
+#include <linux/types.h>
+#include <linux/refcount.h>
+#include <linux/rbtree.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/rhashtable.h>
 
 #define SKULL "skull"
 #define Q_SET_SIZE   16
@@ -21,18 +27,214 @@
 #define SKULL_IOC_EXCHANGE_QSET     _IOWR(SKULL_IOC_MAGIC,  10, int)
 #define SKULL_IOC_SHIFT_QUANTUM     _IO(SKULL_IOC_MAGIC,    11)
 #define SKULL_IOC_SHIFT_QSET        _IO(SKULL_IOC_MAGIC,    12)
-#define SKULL_IOC_MAXNR 12
+#define SKULL_IOC_WCOMBINE          _IO(SKULL_IOC_MAGIC,    13)
+#define SKULL_IOC_FLUSH             _IO(SKULL_IOC_MAGIC,    14)
+#define SKULL_IOC_SET_ENGINE        _IO(SKULL_IOC_MAGIC,    15)
+#define SKULL_IOC_QUERY_ENGINE      _IO(SKULL_IOC_MAGIC,    16)
+#define SKULL_IOC_COPY_RANGE        _IOWR(SKULL_IOC_MAGIC,  17, struct skull_range)
+#define SKULL_IOC_CLONE_RANGE       _IOWR(SKULL_IOC_MAGIC,  18, struct skull_range)
+#define SKULL_IOC_FOLLOW            _IO(SKULL_IOC_MAGIC,    19)
+#define SKULL_IOC_RING_WINDOW       _IOR(SKULL_IOC_MAGIC,   20, struct skull_ring_window)
+#define SKULL_IOC_KV_GET            _IOWR(SKULL_IOC_MAGIC,  21, struct skull_kv)
+#define SKULL_IOC_KV_PUT            _IOW(SKULL_IOC_MAGIC,   22, struct skull_kv)
+#define SKULL_IOC_KV_DELETE         _IOW(SKULL_IOC_MAGIC,   23, struct skull_kv)
+#define SKULL_IOC_KV_SCAN           _IOWR(SKULL_IOC_MAGIC,  24, struct skull_kv_scan)
+#define SKULL_IOC_VERIFY            _IOWR(SKULL_IOC_MAGIC,  25, struct skull_verify)
+#define SKULL_IOC_MAXNR 25
+
+#define SKULL_WC_MAX (1 << 20)  /* biggest write combining buffer per open */
+
+/* io_uring passthrough, used as the cmd_op of an IORING_OP_URING_CMD sqe */
+#define SKULL_URING_QUERY_QUANTUM   1   /* cqe res is the quantum size */
+#define SKULL_URING_QUERY_QSET      2   /* cqe res is the qset size */
+#define SKULL_URING_STATS           3   /* fills the struct skull_stats at addr */
+#define SKULL_URING_RW              4   /* runs the nr struct skull_rw at addr, res is how many ran */
+#define SKULL_URING_MAX_BATCH       1024
+#define SKULL_RW_READ               0
+#define SKULL_RW_WRITE              1
+
+/* the sequence numbers a reader of the ring can still get, [tail, head) */
+struct skull_ring_window {
+    __u64 head;         /* total bytes written since the last trim */
+    __u64 tail;         /* oldest byte still in the ring */
+    __u64 capacity;
+};
+
+/* key/value store, it lives next to the byte stream and is emptied by the same trim */
+#define SKULL_KV_KEY_MAX    64
+#define SKULL_KV_VALUE_MAX  (64 << 10)
+#define SKULL_KV_SCAN_MAX   256     /* records returned by one SKULL_IOC_KV_SCAN */
+
+/* fop capture, read from /sys/kernel/debug/skull/capture as whole struct skull_trace_rec */
+#define SKULL_TRACE_OPEN    0
+#define SKULL_TRACE_READ    1
+#define SKULL_TRACE_WRITE   2
+#define SKULL_TRACE_RELEASE 3
+
+struct skull_kv {
+    __u64 key;          /* user pointer to the key, any bytes */
+    __u64 val;          /* user pointer to the value */
+    __u32 keyLen;       /* 1 to SKULL_KV_KEY_MAX */
+    __u32 valLen;       /* size of val, a get updates it with the size of the stored value */
+};
+
+struct skull_kv_rec {
+    __u32 keyLen;
+    __u32 valLen;
+    char key[SKULL_KV_KEY_MAX];
+};
+
+/* keys come in no particular order, pos says how many matching keys to skip */
+struct skull_kv_scan {
+    __u64 recs;         /* user pointer to nr struct skull_kv_rec */
+    __u64 pos;          /* 0 the first time, advanced by the records returned */
+    __u32 nr;           /* room in recs, updated with how many were filled, less means done */
+    __u32 prefixLen;    /* only keys starting with prefix, 0 for all of them */
+    char prefix[SKULL_KV_KEY_MAX];
+};
+
+/* argument of SKULL_IOC_VERIFY, the range is rounded out to whole quanta */
+struct skull_verify {
+    __u64 off;
+    __u64 len;
+    __u64 bad;          /* user pointer to nrBad __u64, the offsets where corrupt quanta start */
+    __u32 nrBad;        /* room in bad, updated with how many were found, which may be more */
+    __u32 busy;         /* quanta skipped because they were being written */
+    __u64 checked;      /* bytes summed and found right or wrong */
+};
+
+/* one captured fop, polling_d and async_n write the same records */
+struct skull_trace_rec {
+    __u64 ts;           /* CLOCK_MONOTONIC ns when the fop started */
+    __u64 off;          /* file position it started at */
+    __u32 len;          /* bytes asked for, the open flags for an open */
+    __s32 res;          /* what the fop returned, clamped for big reads and writes */
+    __u32 pid;          /* thread that called it */
+    __u32 file;         /* hash of the struct file, the same for every fop of one open */
+    __u32 lat;          /* ns the fop took, saturated */
+    __u16 op;           /* SKULL_TRACE_* */
+    __u8 minor;
+    __u8 dev;           /* 0 from the driver, the capture tool puts its device index here */
+};
+
+/* argument of SKULL_IOC_COPY_RANGE and SKULL_IOC_CLONE_RANGE, issued on the destination */
+struct skull_range {
+    __s64 src_fd;       /* an open skull file to read from */
+    __u64 src_off;
+    __u64 len;          /* bytes to copy, updated with the bytes actually done */
+    __u64 dst_off;
+};
+
+/* the 16 bytes of command data in the sqe, so a normal sized sqe is enough */
+struct skull_uring_cmd {
+    __u64 addr;
+    __u32 nr;
+    __u32 flags;
+};
+
+struct skull_stats {
+    __u64 size;
+    __u64 generation;
+    __s32 quantum;      /* geometry in use */
+    __s32 qset;
+    __s32 nextQuantum;  /* geometry after the next trim */
+    __s32 nextQset;
+};
+
+struct skull_rw {
+    __u64 off;
+    __u64 buf;
+    __u32 len;
+    __u32 op;           /* SKULL_RW_READ or SKULL_RW_WRITE */
+    __s64 result;       /* bytes moved or -errno, filled by the driver */
+};
+
+/* lock and latency statistics, exposed in /sys/kernel/debug/skull/ */
+enum skull_fop { SKULL_FOP_OPEN, SKULL_FOP_READ, SKULL_FOP_WRITE, SKULL_FOP_IOCTL, SKULL_FOP_POLL, SKULL_FOP_RELEASE, SKULL_FOP_NR };
+
+/*
+ * a quantum, refcounted so data can be copied to/from userspace without holding the lock.
+ * The header comes from a cache of its own and data is a separate allocation of exactly
+ * size bytes, so a power of two quantum doesn't spill into the next slab size
+ */
+struct quantum {
+    refcount_t ref;     /* one for every device slot using it, plus one for every copy in flight */
+    atomic_t owners;    /* device slots using it, more than one after a clone */
+    unsigned int size;
+    char* data;
+};
 
 struct node {
     struct node* next;
-    void** data;
+    struct quantum** data;
+};
+
+/* storage engines, like the geometry the choice applies after the next trim */
+#define SKULL_ENGINE_QSET   0   /* linked list of qset arrays of fixed size quanta */
+#define SKULL_ENGINE_EXTENT 1   /* variable sized extents in an rbtree keyed by offset */
+#define SKULL_ENGINE_RING   2   /* fixed size circular buffer, writes append and overwrite the oldest bytes */
+#define SKULL_RING_RECORD_MAX 4096 /* biggest single write into the ring */
+
+struct skull_extent {
+    struct rb_node rb;
+    loff_t start;
+    size_t len;         /* bytes in use, q->size is how far it can grow */
+    struct quantum* q;
+};
+
+/* keys are zero padded so the whole struct can be hashed and compared */
+struct kv_key {
+    u32 len;
+    char data[SKULL_KV_KEY_MAX];
+};
+
+/* never changed once in the table, a put swaps in a new entry */
+struct kv_entry {
+    struct rhash_head node;
+    struct kv_key key;
+    struct quantum* val;      /* the value, val->size is its length */
+    struct rcu_head rcu;
 };
 
 struct skull_d {
     struct node* data;  /* Pointer to first node of the linked lisit */
+    struct quantum* small;    /* all the data of a tiny device, NULL once it uses the list */
+    struct rb_root extents;   /* the data when engine is SKULL_ENGINE_EXTENT */
+    int engine;
+    bool priv;                /* a private instance, freed with the open that made it */
+    bool blk;                 /* the block disk's store: never inline and kept out of lock_stats */
     int quantum;              /* the current quantum size */
     int qset;                 /* the current array size */
-    unsigned long size;       /* amount of data stored here */
+    int qShift;               /* log2 of quantum, -1 when it is not a power of two */
+    int pageShift;            /* log2 of quantum * qset, -1 unless both are powers of two */
+    u64 size;                 /* amount of data stored here, holes included */
+    unsigned long generation; /* bumped on every trim, invalidates cursors */
     struct mutex lock;
+    wait_queue_head_t readq;  /* followers waiting at the end of the device */
+    char* ring;               /* SKULL_ENGINE_RING storage, kept once allocated */
+    size_t ringCap;
+    u64 ringHead;             /* bytes written to the ring since the last trim */
+    spinlock_t ringLock;      /* protects ringHead and writes to ring */
+    struct rhashtable kv;     /* the key/value store, with its own per bucket locks */
     struct cdev skull_cdev;
 };
+
+/* last node touched by an open file, so sequential access does not re walk the list */
+struct skull_cursor {
+    struct node* node;
+    u64 index;
+    unsigned long generation;
+};
+
+/* what we keep in filp->private_data */
+struct skull_file {
+    struct skull_d* dev;
+    struct skull_cursor cursor;
+    bool follow;            /* reads at the end wait for more data instead of returning 0 */
+    char* ringStage;        /* ring writes are copied here before taking the ring lock, taken with xchg */
+    struct mutex wcLock;    /* protects the write combining fields below */
+    char* wcBuf;            /* staged small writes, NULL when write combining is off */
+    size_t wcCap;
+    size_t wcLen;
+    loff_t wcStart;         /* device offset of wcBuf[0] */
+};
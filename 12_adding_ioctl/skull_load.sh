@@ -2,7 +2,7 @@
 module="skull"
 device="skull"
 mode="664"
-maxDevIndex=0
+maxDevIndex=1
 
 rm -f /dev/${device}*  
 
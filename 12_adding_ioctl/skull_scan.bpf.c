@@ -0,0 +1,60 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+/*
+ * Sleepable syscall program that walks every populated chunk of a skull device with
+ * the module's iterator kfuncs and sums its bytes, so only the totals go back to userspace.
+ * The types only need to match the module's by name and layout, libbpf relocates the rest.
+ */
+
+struct bpf_iter_skull {
+    __u64 __opaque[7];
+} __attribute__((aligned(8)));
+
+struct skull_chunk {
+    __u64 off;
+    __u32 len;
+} __attribute__((preserve_access_index));
+
+extern int bpf_iter_skull_new(struct bpf_iter_skull* it, int fd) __ksym;
+extern struct skull_chunk* bpf_iter_skull_next(struct bpf_iter_skull* it) __ksym;
+extern void bpf_iter_skull_destroy(struct bpf_iter_skull* it) __ksym;
+extern int bpf_skull_chunk_read(struct skull_chunk* chunk, __u32 off, void* dst, __u32 dst__sz) __ksym;
+
+/* the context, filled in by skull_scan.c and handed back with the results */
+struct scan_args {
+    int fd;
+    int err;
+    __u64 chunks;
+    __u64 bytes;    /* populated bytes, holes are not visited */
+    __u64 sum;      /* of every byte, as a cheap checksum */
+};
+
+static __u8 buf[4096];
+
+SEC("syscall")
+int scan(struct scan_args* args) {
+    struct bpf_iter_skull it;
+    struct skull_chunk* chunk;
+    __u64 sum = 0;
+    int part, i, n;
+
+    // bpf_for_each would drop what new returns, a bad fd would look like an empty device
+    args->err = bpf_iter_skull_new(&it, args->fd);
+    while ((chunk = bpf_iter_skull_next(&it))) {
+        args->chunks++;
+        args->bytes += chunk->len;
+        bpf_for(part, 0, (chunk->len + sizeof(buf) - 1) / sizeof(buf)) {
+            n = bpf_skull_chunk_read(chunk, part * sizeof(buf), buf, sizeof(buf));
+            for (i = 0; i < sizeof(buf); i++) {
+                if (i >= n) break;
+                sum += buf[i];
+            }
+        }
+    }
+    bpf_iter_skull_destroy(&it);
+    args->sum = sum;
+    return 0;
+}
+
+char LICENSE[] SEC("license") = "GPL";
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+/*
+ * Sums every byte of a skull device twice, once with the read loop a client would write
+ * and once with skull_scan.bpf.o running the scan inside the kernel, and times both.
+ * Holes add nothing to the sum, so both must agree.
+ */
+
+struct scan_args {
+    int fd;
+    int err;
+    unsigned long long chunks;
+    unsigned long long bytes;
+    unsigned long long sum;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long readSum(int fd, unsigned long long* calls) {
+    static unsigned char buf[1 << 16];
+    unsigned long long sum = 0;
+    ssize_t n, i;
+    lseek(fd, 0, SEEK_SET);
+    // skull stops at the end of a quantum, so this is one call per quantum
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++) sum += buf[i];
+        (*calls)++;
+    }
+    return sum;
+}
+
+int main(int argc, char** argv) {
+    const char* device = argc > 1 ? argv[1] : "/dev/skull0";
+    struct bpf_object* obj;
+    struct bpf_program* prog;
+    struct scan_args args = { 0 };
+    unsigned long long readCalls = 0, readTotal;
+    double start, readTime, bpfTime;
+    int fd, err;
+
+    fd = open(device, O_RDONLY);
+    if (fd < 0) {
+        perror(device);
+        return 1;
+    }
+    obj = bpf_object__open_file("skull_scan.bpf.o", NULL);
+    if (!obj || bpf_object__load(obj)) {
+        fprintf(stderr, "could not load skull_scan.bpf.o, is the module loaded with BTF?\n");
+        return 1;
+    }
+    prog = bpf_object__find_program_by_name(obj, "scan");
+    if (!prog) {
+        fprintf(stderr, "skull_scan.bpf.o has no scan program\n");
+        return 1;
+    }
+
+    start = now();
+    readTotal = readSum(fd, &readCalls);
+    readTime = now() - start;
+
+    // syscall programs write the context back into ctx_in
+    LIBBPF_OPTS(bpf_test_run_opts, opts, .ctx_in = &args, .ctx_size_in = sizeof(args));
+    args.fd = fd;
+    start = now();
+    err = bpf_prog_test_run_opts(bpf_program__fd(prog), &opts);
+    bpfTime = now() - start;
+    if (err || args.err) {
+        fprintf(stderr, "scan failed: %s\n", strerror(err ? errno : -args.err));
+        return 1;
+    }
+
+    printf("read loop: %llu calls, sum %llu, %.6f s\n", readCalls, readTotal, readTime);
+    printf("bpf scan:  %llu chunks, %llu bytes, sum %llu, %.6f s\n", args.chunks, args.bytes, args.sum, bpfTime);
+    if (args.sum != readTotal) printf("Oh no!, the sums don't match\n");
+    bpf_object__close(obj);
+    close(fd);
+    return args.sum != readTotal;
+}
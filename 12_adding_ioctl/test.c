@@ -1,9 +1,258 @@
+#define _FILE_OFFSET_BITS 64
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include "test.h"
 
+/* writes a marker far away on a sparse device, reads it back and checks the hole before it */
+static int sparseAt(int fd, off_t off) {
+    char marker[] = "skull was here";
+    char back[sizeof(marker)];
+    char hole[64];
+    int i;
+    if (pwrite(fd, marker, sizeof(marker), off) != sizeof(marker)) {
+        printf("Oh no!, could not write at %lld\n", (long long)off);
+        return 1;
+    }
+    if (pread(fd, back, sizeof(back), off) != sizeof(back) || memcmp(marker, back, sizeof(marker))) {
+        printf("Oh no!, could not read back what we wrote at %lld\n", (long long)off);
+        return 1;
+    }
+    if (pread(fd, hole, sizeof(hole), off - sizeof(hole)) != sizeof(hole)) {
+        printf("Oh no!, could not read the hole before %lld\n", (long long)off);
+        return 1;
+    }
+    for (i = 0; i < sizeof(hole); i++) {
+        if (hole[i]) {
+            printf("Oh no!, the hole before %lld is not zeros\n", (long long)off);
+            return 1;
+        }
+    }
+    if (lseek(fd, 0, SEEK_END) < off + (off_t)sizeof(marker)) {
+        printf("Oh no!, the size is smaller than %lld\n", (long long)off);
+        return 1;
+    }
+    printf("worked! read back what we wrote at %lld\n", (long long)off);
+    return 0;
+}
+
+/* big quanta and qsets keep the node list short, so 1TB is only about a thousand nodes */
+static int sparseTest(void) {
+    int quantum = 1 << 16, qset = 1 << 14, fd, failed = 0;
+    fd = open("/dev/skull0", O_RDWR);
+    ioctl(fd, SKULL_IOC_SET_QUANTUM, &quantum);
+    ioctl(fd, SKULL_IOC_SET_QSET, &qset);
+    close(fd);
+    // opening write only trims, which applies the new geometry
+    close(open("/dev/skull0", O_WRONLY));
+    fd = open("/dev/skull0", O_RDWR);
+    failed += sparseAt(fd, 5LL << 30);
+    failed += sparseAt(fd, 1LL << 40);
+    ioctl(fd, SKULL_IOC_RESET);
+    close(fd);
+    // and back to the default geometry
+    close(open("/dev/skull0", O_WRONLY));
+    return failed;
+}
+
+/* skull moves at most one quantum per call */
+static int fullPio(int fd, char* buf, int len, off_t off, int isRead) {
+    int done = 0, n;
+    while (done < len) {
+        n = isRead ? pread(fd, buf + done, len - done, off + done) : pwrite(fd, buf + done, len - done, off + done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return done;
+}
+
+/* copies and clones the first 4KB inside the device, then checks a write to the clone stays there */
+static int rangeTest(void) {
+    char data[4096], back[4096];
+    struct skull_range range;
+    int i, fd, failed = 0;
+    for (i = 0; i < sizeof(data); i++) data[i] = 'a' + i % 26;
+    fd = open("/dev/skull0", O_WRONLY);
+    close(fd);
+    fd = open("/dev/skull0", O_RDWR);
+    if (fullPio(fd, data, sizeof(data), 0, 0) < 0) {
+        printf("Oh no!, could not fill the device\n");
+        return 1;
+    }
+    range = (struct skull_range){ .src_fd = fd, .src_off = 0, .len = sizeof(data), .dst_off = 1 << 16 };
+    if (ioctl(fd, SKULL_IOC_COPY_RANGE, &range) || range.len != sizeof(data) ||
+        fullPio(fd, back, sizeof(back), 1 << 16, 1) < 0 || memcmp(data, back, sizeof(data))) {
+        printf("Oh no!, the copy is not what we wrote\n");
+        failed++;
+    }
+    else {
+        printf("worked! copied %llu bytes\n", (unsigned long long)range.len);
+    }
+    range = (struct skull_range){ .src_fd = fd, .src_off = 0, .len = sizeof(data), .dst_off = 1 << 17 };
+    if (ioctl(fd, SKULL_IOC_CLONE_RANGE, &range) || range.len != sizeof(data) ||
+        fullPio(fd, back, sizeof(back), 1 << 17, 1) < 0 || memcmp(data, back, sizeof(data))) {
+        printf("Oh no!, the clone is not what we wrote\n");
+        failed++;
+    }
+    else {
+        // writing the clone must not change the original
+        pwrite(fd, "X", 1, 1 << 17);
+        if (fullPio(fd, back, sizeof(back), 0, 1) < 0 || memcmp(data, back, sizeof(data))) {
+            printf("Oh no!, writing the clone changed the original\n");
+            failed++;
+        }
+        else {
+            printf("worked! cloned %llu bytes\n", (unsigned long long)range.len);
+        }
+    }
+    close(fd);
+    // a device this small keeps its data inline, copying past it moves it to the list
+    close(open("/dev/skull0", O_WRONLY));
+    fd = open("/dev/skull0", O_RDWR);
+    if (fullPio(fd, data, 100, 0, 0) < 0) {
+        printf("Oh no!, could not fill the device\n");
+        close(fd);
+        return failed + 1;
+    }
+    range = (struct skull_range){ .src_fd = fd, .src_off = 0, .len = 100, .dst_off = 4096 };
+    if (ioctl(fd, SKULL_IOC_COPY_RANGE, &range) || range.len != 100 ||
+        fullPio(fd, back, 100, 4096, 1) < 0 || memcmp(data, back, 100)) {
+        printf("Oh no!, the copy out of the inline data is not what we wrote\n");
+        failed++;
+    }
+    else {
+        printf("worked! copied %llu inline bytes\n", (unsigned long long)range.len);
+    }
+    close(fd);
+    return failed;
+}
+
+/* fills the ring past its capacity and checks a reader from 0 lands on the oldest byte kept */
+static int ringTest(void) {
+    struct skull_ring_window window;
+    char record[SKULL_RING_RECORD_MAX], back[16];
+    int i, fd, failed = 0;
+    long n;
+    fd = open("/dev/skull0", O_RDWR);
+    if (ioctl(fd, SKULL_IOC_SET_ENGINE, SKULL_ENGINE_RING)) {
+        printf("Oh no!, could not switch to the ring\n");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    close(open("/dev/skull0", O_WRONLY));
+    fd = open("/dev/skull0", O_RDWR);
+    ioctl(fd, SKULL_IOC_RING_WINDOW, &window);
+    // every record starts with its number, so we know what the reader should see
+    for (i = 0; i < window.capacity / sizeof(record) + 10; i++) {
+        memset(record, 0, sizeof(record));
+        snprintf(record, sizeof(back), "%015d", i);
+        if (write(fd, record, sizeof(record)) != sizeof(record)) {
+            printf("Oh no!, a ring write was short\n");
+            failed++;
+            break;
+        }
+    }
+    ioctl(fd, SKULL_IOC_RING_WINDOW, &window);
+    lseek(fd, 0, SEEK_SET);
+    n = read(fd, back, sizeof(back));
+    if (window.head != (unsigned long long)i * sizeof(record) || window.tail != window.head - window.capacity ||
+        n != sizeof(back) || lseek(fd, 0, SEEK_CUR) != window.tail + sizeof(back) ||
+        atoi(back) != window.tail / sizeof(record)) {
+        printf("Oh no!, the ring window is not what we expected\n");
+        failed++;
+    }
+    else {
+        printf("worked! the ring keeps [%llu, %llu)\n", (unsigned long long)window.tail, (unsigned long long)window.head);
+    }
+    ioctl(fd, SKULL_IOC_SET_ENGINE, SKULL_ENGINE_QSET);
+    close(fd);
+    close(open("/dev/skull0", O_WRONLY));
+    return failed;
+}
+
+/* puts a few keys on a private instance, overwrites, deletes and scans them */
+static int kvTest(void) {
+    struct skull_kv_rec recs[SKULL_KV_SCAN_MAX];
+    struct skull_kv_scan scan = { 0 };
+    struct skull_kv kv;
+    char key[16], val[32];
+    int i, fd, found, failed = 0;
+    fd = open("/dev/skull1", O_RDWR);
+    for (i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "%s%d", i % 2 ? "odd" : "even", i);
+        snprintf(val, sizeof(val), "value %d", i);
+        kv = (struct skull_kv){ (unsigned long)key, (unsigned long)val, strlen(key), strlen(val) + 1 };
+        if (ioctl(fd, SKULL_IOC_KV_PUT, &kv)) failed++;
+    }
+    // replace one and delete another
+    snprintf(val, sizeof(val), "new");
+    kv = (struct skull_kv){ (unsigned long)"even0", (unsigned long)val, 5, 4 };
+    if (ioctl(fd, SKULL_IOC_KV_PUT, &kv)) failed++;
+    kv = (struct skull_kv){ (unsigned long)"odd1", 0, 4, 0 };
+    if (ioctl(fd, SKULL_IOC_KV_DELETE, &kv) || ioctl(fd, SKULL_IOC_KV_GET, &kv) != -1) failed++;
+    memset(val, 0, sizeof(val));
+    kv = (struct skull_kv){ (unsigned long)"even0", (unsigned long)val, 5, sizeof(val) };
+    if (ioctl(fd, SKULL_IOC_KV_GET, &kv) || kv.valLen != 4 || strcmp(val, "new")) failed++;
+    kv = (struct skull_kv){ (unsigned long)"even42", (unsigned long)val, 6, sizeof(val) };
+    if (ioctl(fd, SKULL_IOC_KV_GET, &kv) || strcmp(val, "value 42")) failed++;
+    // the odd keys, a few at a time
+    found = 0;
+    memcpy(scan.prefix, "odd", 3);
+    scan.prefixLen = 3;
+    scan.recs = (unsigned long)recs;
+    do {
+        scan.nr = 7;
+        if (ioctl(fd, SKULL_IOC_KV_SCAN, &scan)) {
+            failed++;
+            break;
+        }
+        found += scan.nr;
+    } while (scan.nr == 7);
+    if (found != 49) failed++;
+    if (failed) {
+        printf("Oh no!, the key/value store failed %d checks\n", failed);
+    }
+    else {
+        printf("worked! the key/value store scanned %d odd keys\n", found);
+    }
+    close(fd);
+    return failed;
+}
+
+/* nothing scribbles on skull here, so a verify of what we just wrote must find it all good */
+static int verifyTest(void) {
+    struct skull_verify verify = { 0 };
+    unsigned long long bad[16];
+    char data[8192];
+    int fd, failed = 0;
+    memset(data, 'v', sizeof(data));
+    fd = open("/dev/skull1", O_RDWR);
+    fullPio(fd, data, sizeof(data), 0, 0);
+    verify = (struct skull_verify){ .off = 0, .len = sizeof(data), .bad = (unsigned long)bad, .nrBad = 16 };
+    if (ioctl(fd, SKULL_IOC_VERIFY, &verify)) {
+        if (errno == EOPNOTSUPP) {
+            printf("checksums are off, load with checksum=1 to test them\n");
+        }
+        else {
+            printf("Oh no!, verify failed: %s\n", strerror(errno));
+            failed++;
+        }
+    }
+    else if (verify.nrBad || verify.checked < sizeof(data)) {
+        printf("Oh no!, verify found %u bad quanta and checked %llu bytes\n", verify.nrBad, (unsigned long long)verify.checked);
+        failed++;
+    }
+    else {
+        printf("worked! verified %llu bytes\n", (unsigned long long)verify.checked);
+    }
+    close(fd);
+    return failed;
+}
 
 int main(void) {
     int newQuantumSize = 32;
@@ -24,5 +273,6 @@ int main(void) {
     else {
         printf("worked! the actual size now is %d\n", actualQuantumSize);
     }
-    return 0;
+    close(fd);
+    return sparseTest() + rangeTest() + ringTest() + kvTest() + verifyTest();
 }
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <sys/ioctl.h>
+#include <linux/types.h>
 
 #define Q_SET_SIZE   16
 #define QUANTUM_SIZE 16
@@ -18,4 +19,129 @@
 #define SKULL_IOC_EXCHANGE_QSET     _IOWR(SKULL_IOC_MAGIC,  10, int)
 #define SKULL_IOC_SHIFT_QUANTUM     _IO(SKULL_IOC_MAGIC,    11)
 #define SKULL_IOC_SHIFT_QSET        _IO(SKULL_IOC_MAGIC,    12)
-#define SKULL_IOC_MAXNR 12
\ No newline at end of file
+#define SKULL_IOC_WCOMBINE          _IO(SKULL_IOC_MAGIC,    13)
+#define SKULL_IOC_FLUSH             _IO(SKULL_IOC_MAGIC,    14)
+#define SKULL_IOC_SET_ENGINE        _IO(SKULL_IOC_MAGIC,    15)
+#define SKULL_IOC_QUERY_ENGINE      _IO(SKULL_IOC_MAGIC,    16)
+#define SKULL_IOC_COPY_RANGE        _IOWR(SKULL_IOC_MAGIC,  17, struct skull_range)
+#define SKULL_IOC_CLONE_RANGE       _IOWR(SKULL_IOC_MAGIC,  18, struct skull_range)
+#define SKULL_IOC_FOLLOW            _IO(SKULL_IOC_MAGIC,    19)
+#define SKULL_IOC_RING_WINDOW       _IOR(SKULL_IOC_MAGIC,   20, struct skull_ring_window)
+#define SKULL_IOC_KV_GET            _IOWR(SKULL_IOC_MAGIC,  21, struct skull_kv)
+#define SKULL_IOC_KV_PUT            _IOW(SKULL_IOC_MAGIC,   22, struct skull_kv)
+#define SKULL_IOC_KV_DELETE         _IOW(SKULL_IOC_MAGIC,   23, struct skull_kv)
+#define SKULL_IOC_KV_SCAN           _IOWR(SKULL_IOC_MAGIC,  24, struct skull_kv_scan)
+#define SKULL_IOC_VERIFY            _IOWR(SKULL_IOC_MAGIC,  25, struct skull_verify)
+#define SKULL_IOC_MAXNR 25
+
+#define SKULL_ENGINE_QSET   0
+#define SKULL_ENGINE_EXTENT 1
+#define SKULL_ENGINE_RING   2
+#define SKULL_RING_RECORD_MAX 4096
+
+#define SKULL_WC_MAX (1 << 20)  /* biggest write combining buffer per open */
+
+/* io_uring passthrough, used as the cmd_op of an IORING_OP_URING_CMD sqe */
+#define SKULL_URING_QUERY_QUANTUM   1   /* cqe res is the quantum size */
+#define SKULL_URING_QUERY_QSET      2   /* cqe res is the qset size */
+#define SKULL_URING_STATS           3   /* fills the struct skull_stats at addr */
+#define SKULL_URING_RW              4   /* runs the nr struct skull_rw at addr, res is how many ran */
+#define SKULL_URING_MAX_BATCH       1024
+#define SKULL_RW_READ               0
+#define SKULL_RW_WRITE              1
+
+/* the sequence numbers a reader of the ring can still get, [tail, head) */
+struct skull_ring_window {
+    __u64 head;         /* total bytes written since the last trim */
+    __u64 tail;         /* oldest byte still in the ring */
+    __u64 capacity;
+};
+
+/* key/value store, it lives next to the byte stream and is emptied by the same trim */
+#define SKULL_KV_KEY_MAX    64
+#define SKULL_KV_VALUE_MAX  (64 << 10)
+#define SKULL_KV_SCAN_MAX   256     /* records returned by one SKULL_IOC_KV_SCAN */
+
+/* fop capture, read from /sys/kernel/debug/skull/capture as whole struct skull_trace_rec */
+#define SKULL_TRACE_OPEN    0
+#define SKULL_TRACE_READ    1
+#define SKULL_TRACE_WRITE   2
+#define SKULL_TRACE_RELEASE 3
+
+struct skull_kv {
+    __u64 key;          /* user pointer to the key, any bytes */
+    __u64 val;          /* user pointer to the value */
+    __u32 keyLen;       /* 1 to SKULL_KV_KEY_MAX */
+    __u32 valLen;       /* size of val, a get updates it with the size of the stored value */
+};
+
+struct skull_kv_rec {
+    __u32 keyLen;
+    __u32 valLen;
+    char key[SKULL_KV_KEY_MAX];
+};
+
+/* keys come in no particular order, pos says how many matching keys to skip */
+struct skull_kv_scan {
+    __u64 recs;         /* user pointer to nr struct skull_kv_rec */
+    __u64 pos;          /* 0 the first time, advanced by the records returned */
+    __u32 nr;           /* room in recs, updated with how many were filled, less means done */
+    __u32 prefixLen;    /* only keys starting with prefix, 0 for all of them */
+    char prefix[SKULL_KV_KEY_MAX];
+};
+
+/* argument of SKULL_IOC_VERIFY, the range is rounded out to whole quanta */
+struct skull_verify {
+    __u64 off;
+    __u64 len;
+    __u64 bad;          /* user pointer to nrBad __u64, the offsets where corrupt quanta start */
+    __u32 nrBad;        /* room in bad, updated with how many were found, which may be more */
+    __u32 busy;         /* quanta skipped because they were being written */
+    __u64 checked;      /* bytes summed and found right or wrong */
+};
+
+/* one captured fop, polling_d and async_n write the same records */
+struct skull_trace_rec {
+    __u64 ts;           /* CLOCK_MONOTONIC ns when the fop started */
+    __u64 off;          /* file position it started at */
+    __u32 len;          /* bytes asked for, the open flags for an open */
+    __s32 res;          /* what the fop returned, clamped for big reads and writes */
+    __u32 pid;          /* thread that called it */
+    __u32 file;         /* hash of the struct file, the same for every fop of one open */
+    __u32 lat;          /* ns the fop took, saturated */
+    __u16 op;           /* SKULL_TRACE_* */
+    __u8 minor;
+    __u8 dev;           /* 0 from the driver, the capture tool puts its device index here */
+};
+
+/* argument of SKULL_IOC_COPY_RANGE and SKULL_IOC_CLONE_RANGE, issued on the destination */
+struct skull_range {
+    __s64 src_fd;       /* an open skull file to read from */
+    __u64 src_off;
+    __u64 len;          /* bytes to copy, updated with the bytes actually done */
+    __u64 dst_off;
+};
+
+/* the 16 bytes of command data in the sqe, so a normal sized sqe is enough */
+struct skull_uring_cmd {
+    __u64 addr;
+    __u32 nr;
+    __u32 flags;
+};
+
+struct skull_stats {
+    __u64 size;
+    __u64 generation;
+    __s32 quantum;      /* geometry in use */
+    __s32 qset;
+    __s32 nextQuantum;  /* geometry after the next trim */
+    __s32 nextQset;
+};
+
+struct skull_rw {
+    __u64 off;
+    __u64 buf;
+    __u32 len;
+    __u32 op;           /* SKULL_RW_READ or SKULL_RW_WRITE */
+    __s64 result;       /* bytes moved or -errno, filled by the driver */
+};
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <linux/cdev.h>
 #include <linux/sched.h>
 #include <linux/wait.h>
+#include <linux/slab.h>
 #include <linux/errno.h> /* EFAULT */
 
 #define SLEEPY "sleepy"
@@ -15,6 +16,12 @@ static int count = 1;
 static DECLARE_WAIT_QUEUE_HEAD(wq);
 const char* PREF = "[ sleepy ] - ";
 static int flag = 0;
+static struct dentry* debugDir;
+
+enum dev_fop { FOP_OPEN, FOP_READ, FOP_WRITE, FOP_RELEASE, FOP_NR };
+static const char* fopNames[FOP_NR] = { "open", "read", "write", "release" };
+#define STATS_FOP_NR FOP_NR
+#include "../common/fop_latency.h"
 
 
 
@@ -48,12 +55,52 @@ static int release(struct inode* inode, struct file* filp) {
 }
 
 
+static int timed_open(struct inode* inode, struct file* filp) {
+    int result;
+    u64 start;
+    if (!fopHist) return open(inode, filp);
+    start = ktime_get_ns();
+    result = open(inode, filp);
+    fop_latency_add(FOP_OPEN, start);
+    return result;
+}
+
+static ssize_t timed_read(struct file* filp, char __user* buf, size_t len, loff_t* off) {
+    ssize_t result;
+    u64 start;
+    if (!fopHist) return read(filp, buf, len, off);
+    start = ktime_get_ns();
+    result = read(filp, buf, len, off);
+    fop_latency_add(FOP_READ, start);
+    return result;
+}
+
+static ssize_t timed_write(struct file* filp, const char __user* buf, size_t len, loff_t* off) {
+    ssize_t result;
+    u64 start;
+    if (!fopHist) return write(filp, buf, len, off);
+    start = ktime_get_ns();
+    result = write(filp, buf, len, off);
+    fop_latency_add(FOP_WRITE, start);
+    return result;
+}
+
+static int timed_release(struct inode* inode, struct file* filp) {
+    int result;
+    u64 start;
+    if (!fopHist) return release(inode, filp);
+    start = ktime_get_ns();
+    result = release(inode, filp);
+    fop_latency_add(FOP_RELEASE, start);
+    return result;
+}
+
 static const struct file_operations fops = {
   .owner = THIS_MODULE,
-  .open = open,
-  .read = read,
-  .write = write,
-  .release = release,
+  .open = timed_open,
+  .read = timed_read,
+  .write = timed_write,
+  .release = timed_release,
 };
 
 static struct cdev sleepy;
@@ -78,6 +125,9 @@ static int init(void) {
     }
     pr_alert("%s - Character device ready to use\n", PREF);
 
+    // debugfs is only for inspection, we keep going even if it fails
+    debugDir = debugfs_create_dir(SLEEPY, NULL);
+    fop_latency_init(debugDir, PREF);
 
     return 0;
 
@@ -90,6 +140,8 @@ error:
 }
 
 static void exit_sleepy(void) {
+    debugfs_remove_recursive(debugDir);
+    free_percpu(fopHist);
     cdev_del(&sleepy);
     pr_alert("%s - Character device struct deallocated!\n", PREF);
     unregister_chrdev_region(devNum, count);
@@ -30,13 +30,30 @@ struct polling_dev_t {
 
 static struct polling_dev_t polling_d = { .buffSize = 256, .numOfReaders = 0, .numOfWriters = 0, .buffNotEmpty = 0 };
 
+/* lock and latency statistics and the fop capture, exposed in /sys/kernel/debug/polling_d/ */
+enum dev_fop { FOP_OPEN, FOP_READ, FOP_WRITE, FOP_POLL, FOP_RELEASE, FOP_NR };
+static struct dentry* debugDir;
+static const char* fopNames[FOP_NR] = { "open", "read", "write", "poll", "release" };
+#define STATS_FOP_NR FOP_NR
+#include "../common/lock_stats.h"
+#include "../common/fop_latency.h"
+#include "../common/fop_capture.h"
+
+static int lock_dev(struct polling_dev_t* dev, int fop, u64* lockedAt, bool interruptible) {
+    return stats_lock(&dev->lock, fop, lockedAt, interruptible, 0);
+}
+
+static void unlock_dev(struct polling_dev_t* dev, int fop, u64 lockedAt) {
+    stats_unlock(&dev->lock, fop, lockedAt);
+}
 
 static int open(struct inode* inode, struct file* filp) {
     struct polling_dev_t* dev;
+    u64 lockedAt;
     dev = container_of(inode->i_cdev, struct polling_dev_t, cdev);
     filp->private_data = dev;
     pr_info("%s PID-> %d | OPEN triggered\n", PREF, current->pid);
-    if (mutex_lock_interruptible(&dev->lock)) {
+    if (lock_dev(dev, FOP_OPEN, &lockedAt, true)) {
         pr_info("%s PID-> %d | could not get mutex\n", PREF, current->pid);
         // make the vfs take care or re try the syscall
         // this should be transparent for the userspace process
@@ -46,7 +63,7 @@ static int open(struct inode* inode, struct file* filp) {
         pr_info("%s PID-> %d | allocating memory\n", PREF, current->pid);
         dev->buff = kmalloc(dev->buffSize, GFP_KERNEL);
         if (!dev->buff) {
-            mutex_unlock(&dev->lock);
+            unlock_dev(dev, FOP_OPEN, lockedAt);
             return -ENOMEM;
         }
     }
@@ -56,7 +73,7 @@ static int open(struct inode* inode, struct file* filp) {
     if (filp->f_mode & FMODE_WRITE) {
         dev->numOfWriters++;
     }
-    mutex_unlock(&dev->lock);
+    unlock_dev(dev, FOP_OPEN, lockedAt);
 
 
     return nonseekable_open(inode, filp);
@@ -66,9 +83,10 @@ static int open(struct inode* inode, struct file* filp) {
 
 static ssize_t read(struct file* filp, char __user* buf, size_t len, loff_t* off) {
     struct polling_dev_t* dev;
+    u64 lockedAt;
     dev = filp->private_data;
     pr_info("%s PID-> %d | READ triggered\n", PREF, current->pid);
-    if (mutex_lock_interruptible(&dev->lock)) {
+    if (lock_dev(dev, FOP_READ, &lockedAt, true)) {
         pr_info("%s PID-> %d | couldn't held the lock\n", PREF, current->pid);
         return -ERESTARTSYS;
     }
@@ -78,43 +96,45 @@ static ssize_t read(struct file* filp, char __user* buf, size_t len, loff_t* off
     }
     pr_info("%s PID-> %d | to read len -> %ld \n", PREF, current->pid, len);
     if (copy_to_user(buf, dev->buff, len)) {
-        mutex_unlock(&dev->lock);
+        unlock_dev(dev, FOP_READ, lockedAt);
         return -EFAULT;
     }
     memset(dev->buff, 0, dev->buffSize);
     dev->buffNotEmpty = 0;
-    mutex_unlock(&dev->lock);
+    unlock_dev(dev, FOP_READ, lockedAt);
     return len;
 }
 
 static ssize_t write(struct file* filp, const char __user* buf, size_t len, loff_t* off) {
     struct polling_dev_t* dev;
+    u64 lockedAt;
     dev = filp->private_data;
     pr_info("%s PID-> %d | WRITE triggered\n", PREF, current->pid);
-    if (mutex_lock_interruptible(&dev->lock)) {
+    if (lock_dev(dev, FOP_WRITE, &lockedAt, true)) {
         return -ERESTARTSYS;
     }
     len = min(len, (size_t)dev->buffSize);
     pr_info("%s PID-> %d | to write len -> %ld\n", PREF, current->pid, len);
     memset(dev->buff, 0, dev->buffSize);
     if (copy_from_user(dev->buff, buf, len)) {
-        mutex_unlock(&dev->lock);
+        unlock_dev(dev, FOP_WRITE, lockedAt);
         return -EFAULT;
     }
     dev->buffNotEmpty = 1;
-    mutex_unlock(&dev->lock);
+    unlock_dev(dev, FOP_WRITE, lockedAt);
     return len;
 }
 
 static unsigned int poll(struct file* filp, poll_table* wait) {
 
     struct polling_dev_t* dev;
+    u64 lockedAt;
     unsigned int mask;
 
     pr_info("%s PID-> %d | POLL triggered, checking if we can read or write \n", PREF, current->pid);
     dev = filp->private_data;
     mask = 0;
-    mutex_lock(&dev->lock);
+    lock_dev(dev, FOP_POLL, &lockedAt, false);
     poll_wait(filp, &dev->inq, wait);
     poll_wait(filp, &dev->outq, wait);
     if (dev->buffNotEmpty == 1) {
@@ -123,14 +143,15 @@ static unsigned int poll(struct file* filp, poll_table* wait) {
     else if (dev->buffNotEmpty == 0) {
         mask |= POLLOUT | POLLWRNORM;
     }
-    mutex_unlock(&dev->lock);
+    unlock_dev(dev, FOP_POLL, lockedAt);
     return mask;
 }
 
 static int release(struct inode* inode, struct file* filp) {
     struct polling_dev_t* dev;
+    u64 lockedAt;
     dev = filp->private_data;
-    mutex_lock(&dev->lock);
+    lock_dev(dev, FOP_RELEASE, &lockedAt, false);
     if (filp->f_mode & FMODE_READ) {
         dev->numOfReaders--;
     }
@@ -142,18 +163,74 @@ static int release(struct inode* inode, struct file* filp) {
         kfree(dev->buff);
         dev->buff = NULL;
     }
-    mutex_unlock(&dev->lock);
+    unlock_dev(dev, FOP_RELEASE, lockedAt);
     return 0;
 }
 
 
+static int timed_open(struct inode* inode, struct file* filp) {
+    int result;
+    u64 start, end;
+    if (!fopHist && !capturing) return open(inode, filp);
+    start = ktime_get_ns();
+    result = open(inode, filp);
+    end = fop_latency_add(FOP_OPEN, start);
+    trace_add(TRACE_OPEN, filp, 0, filp->f_flags, result, start, end);
+    return result;
+}
+
+static ssize_t timed_read(struct file* filp, char __user* buf, size_t len, loff_t* off) {
+    ssize_t result;
+    loff_t pos = *off;
+    u64 start, end;
+    if (!fopHist && !capturing) return read(filp, buf, len, off);
+    start = ktime_get_ns();
+    result = read(filp, buf, len, off);
+    end = fop_latency_add(FOP_READ, start);
+    trace_add(TRACE_READ, filp, pos, len, result, start, end);
+    return result;
+}
+
+static ssize_t timed_write(struct file* filp, const char __user* buf, size_t len, loff_t* off) {
+    ssize_t result;
+    loff_t pos = *off;
+    u64 start, end;
+    if (!fopHist && !capturing) return write(filp, buf, len, off);
+    start = ktime_get_ns();
+    result = write(filp, buf, len, off);
+    end = fop_latency_add(FOP_WRITE, start);
+    trace_add(TRACE_WRITE, filp, pos, len, result, start, end);
+    return result;
+}
+
+static unsigned int timed_poll(struct file* filp, poll_table* wait) {
+    unsigned int mask;
+    u64 start;
+    if (!fopHist) return poll(filp, wait);
+    start = ktime_get_ns();
+    mask = poll(filp, wait);
+    fop_latency_add(FOP_POLL, start);
+    return mask;
+}
+
+static int timed_release(struct inode* inode, struct file* filp) {
+    int result;
+    u64 start, end;
+    if (!fopHist && !capturing) return release(inode, filp);
+    start = ktime_get_ns();
+    result = release(inode, filp);
+    end = fop_latency_add(FOP_RELEASE, start);
+    trace_add(TRACE_RELEASE, filp, 0, 0, result, start, end);
+    return result;
+}
+
 static const struct file_operations fops = {
   .owner = THIS_MODULE,
-  .open = open,
-  .read = read,
-  .write = write,
-  .release = release,
-  .poll = poll,
+  .open = timed_open,
+  .read = timed_read,
+  .write = timed_write,
+  .release = timed_release,
+  .poll = timed_poll,
 };
 
 
@@ -180,6 +257,12 @@ static int init(void) {
         goto remove_cdev;
     }
     pr_alert("%s - Character device ready to use\n", PREF);
+
+    // debugfs is only for inspection, we keep going even if it fails
+    debugDir = debugfs_create_dir(ASYNC, NULL);
+    lock_stats_init(debugDir);
+    fop_latency_init(debugDir, PREF);
+    fop_capture_init(debugDir, PREF);
     return 0;
 
 remove_cdev:
@@ -191,6 +274,9 @@ error:
 }
 
 static void exit_polling_d(void) {
+    debugfs_remove_recursive(debugDir);
+    free_percpu(fopHist);
+    kvfree(traceBuf);
     cdev_del(&polling_d.cdev);
     pr_alert("%s - Character device struct deallocated!\n", PREF);
     unregister_chrdev_region(devNum, count);
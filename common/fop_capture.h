@@ -0,0 +1,93 @@
+#ifndef COMMON_FOP_CAPTURE_H
+#define COMMON_FOP_CAPTURE_H
+
+/*
+ * Fop capture for replay, for skull, async_n and polling_d. With capture=N the module's
+ * timed_* wrappers call trace_add after every open, read, write and release, and
+ * /sys/kernel/debug/<module>/capture hands the records out to 12_adding_ioctl/replay.
+ */
+
+#include <linux/kfifo.h>
+#include <linux/hash.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+
+enum trace_op { TRACE_OPEN, TRACE_READ, TRACE_WRITE, TRACE_RELEASE };
+
+// same layout as struct skull_trace_rec in 12_adding_ioctl/skull.h, which documents the fields
+struct trace_rec {
+    u64 ts;
+    u64 off;
+    u32 len;
+    s32 res;
+    u32 pid;
+    u32 file;
+    u32 lat;
+    u16 op;
+    u8 minor;
+    u8 dev;
+};
+
+static unsigned int capture;
+module_param(capture, uint, 0444);
+MODULE_PARM_DESC(capture, "records buffered by the fop capture, rounded down to a power of 2 (default 0, off)");
+static DECLARE_KFIFO_PTR(traceFifo, struct trace_rec);
+static DEFINE_SPINLOCK(traceLock);
+static DEFINE_MUTEX(traceReadLock);
+static void* traceBuf;
+static bool capturing;
+static u64 traceDropped;
+
+// a full fifo drops the record and counts it, the fops never wait for whoever drains it
+static void trace_add(int op, struct file* filp, loff_t off, size_t len, long res, u64 start, u64 end) {
+    struct trace_rec rec;
+    if (!capturing) return;
+    rec.ts = start;
+    rec.off = off;
+    rec.len = min_t(size_t, len, U32_MAX);
+    rec.res = clamp_t(long, res, S32_MIN, S32_MAX);
+    rec.pid = current->pid;
+    rec.file = hash_ptr(filp, 32);
+    rec.lat = min_t(u64, end - start, U32_MAX);
+    rec.op = op;
+    rec.minor = iminor(file_inode(filp));
+    rec.dev = 0;
+    spin_lock(&traceLock);
+    if (!kfifo_put(&traceFifo, rec)) traceDropped++;
+    spin_unlock(&traceLock);
+}
+
+// hands out whole records only, and forgets what it handed out. 0 means nothing new yet
+static ssize_t capture_read(struct file* filp, char __user* buf, size_t len, loff_t* off) {
+    unsigned int copied;
+    int err;
+    if (len < sizeof(struct trace_rec)) return -EINVAL;
+    mutex_lock(&traceReadLock);
+    err = kfifo_to_user(&traceFifo, buf, len - len % sizeof(struct trace_rec), &copied);
+    mutex_unlock(&traceReadLock);
+    return err ? err : copied;
+}
+
+static const struct file_operations capture_fops = {
+  .owner = THIS_MODULE,
+  .read = capture_read,
+};
+
+// without memory the module runs without the capture, like with the parameter off
+static void fop_capture_init(struct dentry* dir, const char* pref) {
+    if (!capture) return;
+    capture = min(capture, 1U << 24);
+    traceBuf = kvmalloc_array(capture, sizeof(struct trace_rec), GFP_KERNEL);
+    if (!traceBuf || kfifo_init(&traceFifo, traceBuf, capture * sizeof(struct trace_rec))) {
+        pr_alert("%s - no memory for the capture, running without it\n", pref);
+        return;
+    }
+    capturing = true;
+    debugfs_create_file("capture", 0400, dir, NULL, &capture_fops);
+    debugfs_create_u64("capture_dropped", 0444, dir, &traceDropped);
+}
+
+#endif
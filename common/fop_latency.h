@@ -0,0 +1,121 @@
+#ifndef COMMON_FOP_LATENCY_H
+#define COMMON_FOP_LATENCY_H
+
+/*
+ * Per fop service time histograms, for skull, sleepy, async_n and polling_d.
+ * Off unless the module is loaded with fop_latency=1, then the timed_* wrappers of the
+ * module call fop_latency_add around every fop.
+ * Define STATS_FOP_NR and fopNames[STATS_FOP_NR] before including it.
+ */
+
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+/* HDR style: 8 linear sub buckets for every power of two */
+#define HDR_SUB_BITS 3
+#define HDR_SUB (1 << HDR_SUB_BITS)
+#define HDR_BUCKETS ((40 - HDR_SUB_BITS + 1) * HDR_SUB) /* up to ~2^40 ns */
+
+struct fop_hist {
+    u64 count[STATS_FOP_NR][HDR_BUCKETS];
+};
+
+static bool fop_latency;
+module_param(fop_latency, bool, 0444);
+MODULE_PARM_DESC(fop_latency, "keep per fop latency histograms in debugfs (default off)");
+static struct fop_hist __percpu* fopHist;
+
+static int hdr_index(u64 ns) {
+    int shift;
+    if (ns < HDR_SUB) return ns;
+    shift = fls64(ns) - HDR_SUB_BITS - 1;
+    return min((shift + 1) * HDR_SUB + (int)(ns >> shift) - HDR_SUB, HDR_BUCKETS - 1);
+}
+
+// exclusive upper bound of a bucket, in ns
+static u64 hdr_upper(int idx) {
+    int shift;
+    if (idx < HDR_SUB) return idx + 1;
+    shift = idx / HDR_SUB - 1;
+    return (u64)(HDR_SUB + idx % HDR_SUB + 1) << shift;
+}
+
+// returns when the fop ended, so the capture doesn't read the clock again
+static u64 fop_latency_add(int fop, u64 start) {
+    u64 now = ktime_get_ns();
+    if (fopHist) this_cpu_inc(fopHist->count[fop][hdr_index(now - start)]);
+    return now;
+}
+
+// percentiles come in parts per ten thousand, so p999 is 9990
+static u64 hdr_percentile(u64* merged, u64 total, u64 ptt) {
+    u64 target, seen = 0;
+    int i;
+    target = max_t(u64, div64_u64(total * ptt + 9999, 10000), 1);
+    for (i = 0; i < HDR_BUCKETS; i++) {
+        seen += merged[i];
+        if (seen >= target) return hdr_upper(i);
+    }
+    return hdr_upper(HDR_BUCKETS - 1);
+}
+
+// every cpu keeps its own counters, we only add them up when somebody asks
+static int fop_latency_show(struct seq_file* s, void* unused) {
+    u64* merged;
+    u64 total;
+    int fop, cpu, i;
+
+    merged = kmalloc_array(HDR_BUCKETS, sizeof(u64), GFP_KERNEL);
+    if (!merged) return -ENOMEM;
+    seq_printf(s, "%-8s %12s %12s %12s %12s\n", "fop", "count", "p50_ns", "p99_ns", "p999_ns");
+    for (fop = 0; fop < STATS_FOP_NR; fop++) {
+        memset(merged, 0, HDR_BUCKETS * sizeof(u64));
+        total = 0;
+        for_each_possible_cpu(cpu) {
+            for (i = 0; i < HDR_BUCKETS; i++) {
+                merged[i] += per_cpu_ptr(fopHist, cpu)->count[fop][i];
+            }
+        }
+        for (i = 0; i < HDR_BUCKETS; i++) {
+            total += merged[i];
+        }
+        if (!total) continue;
+        seq_printf(s, "%-8s %12llu %12llu %12llu %12llu\n", fopNames[fop], total,
+            hdr_percentile(merged, total, 5000), hdr_percentile(merged, total, 9900), hdr_percentile(merged, total, 9990));
+    }
+    kfree(merged);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fop_latency);
+
+static ssize_t fop_latency_reset(struct file* filp, const char __user* buf, size_t len, loff_t* off) {
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(fopHist, cpu), 0, sizeof(struct fop_hist));
+    }
+    return len;
+}
+
+static const struct file_operations fop_latency_reset_fops = {
+  .owner = THIS_MODULE,
+  .write = fop_latency_reset,
+};
+
+// without memory the module runs without histograms, like with the parameter off
+static void fop_latency_init(struct dentry* dir, const char* pref) {
+    if (!fop_latency) return;
+    fopHist = alloc_percpu(struct fop_hist);
+    if (!fopHist) {
+        pr_alert("%s - no memory for latency histograms, running without them\n", pref);
+        return;
+    }
+    debugfs_create_file("fop_latency", 0444, dir, NULL, &fop_latency_fops);
+    debugfs_create_file("fop_latency_reset", 0200, dir, NULL, &fop_latency_reset_fops);
+}
+
+#endif
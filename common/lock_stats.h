@@ -0,0 +1,109 @@
+#ifndef COMMON_LOCK_STATS_H
+#define COMMON_LOCK_STATS_H
+
+/*
+ * Lock wait and hold histograms per fop, for skull, async_n and polling_d.
+ * Every module is a single file and includes this once, so everything here is static.
+ * Define STATS_FOP_NR and fopNames[STATS_FOP_NR] before including it.
+ */
+
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#define LOCK_HIST_BUCKETS 40 /* bucket i counts times in [2^(i-1), 2^i) ns */
+
+struct lock_stats {
+    atomic64_t wait[STATS_FOP_NR][LOCK_HIST_BUCKETS];
+    atomic64_t hold[STATS_FOP_NR][LOCK_HIST_BUCKETS];
+};
+
+static struct lock_stats lockStats;
+
+static void lock_hist_add(atomic64_t* hist, u64 ns) {
+    atomic64_inc(&hist[min(fls64(ns), LOCK_HIST_BUCKETS - 1)]);
+}
+
+/*
+ * Every acquisition is timed from the moment it holds the lock, so a long hold shows up
+ * whether or not anyone waited for it. Only the wait skips the clock: an uncontended
+ * acquisition counts as a zero wait, and the clock is read before locking only when
+ * mutex_trylock fails. A lockedAt of 0 means the caller went around stats_lock.
+ */
+static int stats_lock(struct mutex* lock, int fop, u64* lockedAt, bool interruptible, unsigned int subclass) {
+    u64 start;
+    *lockedAt = 0;
+    if (mutex_trylock(lock)) {
+        *lockedAt = ktime_get_ns();
+        atomic64_inc(&lockStats.wait[fop][0]);
+        return 0;
+    }
+    start = ktime_get_ns();
+    if (!interruptible) {
+        mutex_lock_nested(lock, subclass);
+    }
+    else if (mutex_lock_interruptible_nested(lock, subclass)) {
+        return -ERESTARTSYS;
+    }
+    *lockedAt = ktime_get_ns();
+    lock_hist_add(lockStats.wait[fop], *lockedAt - start);
+    return 0;
+}
+
+static void stats_unlock(struct mutex* lock, int fop, u64 lockedAt) {
+    u64 held;
+    if (!lockedAt) {
+        mutex_unlock(lock);
+        return;
+    }
+    held = ktime_get_ns() - lockedAt;
+    mutex_unlock(lock);
+    lock_hist_add(lockStats.hold[fop], held);
+}
+
+static void show_hist(struct seq_file* s, const char* fop, const char* kind, atomic64_t* hist) {
+    int i;
+    s64 n;
+    for (i = 0; i < LOCK_HIST_BUCKETS; i++) {
+        n = atomic64_read(&hist[i]);
+        if (!n) continue;
+        seq_printf(s, "%-8s %-5s %14llu %14llu %12lld\n", fop, kind, i ? 1ULL << (i - 1) : 0, 1ULL << i, n);
+    }
+}
+
+static int lock_stats_show(struct seq_file* s, void* unused) {
+    int fop;
+    seq_printf(s, "%-8s %-5s %14s %14s %12s\n", "fop", "kind", "from_ns", "to_ns", "count");
+    for (fop = 0; fop < STATS_FOP_NR; fop++) {
+        show_hist(s, fopNames[fop], "wait", lockStats.wait[fop]);
+        show_hist(s, fopNames[fop], "hold", lockStats.hold[fop]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(lock_stats);
+
+// writing anything to the reset file clears the histograms
+static ssize_t lock_stats_reset(struct file* filp, const char __user* buf, size_t len, loff_t* off) {
+    int fop, i;
+    for (fop = 0; fop < STATS_FOP_NR; fop++) {
+        for (i = 0; i < LOCK_HIST_BUCKETS; i++) {
+            atomic64_set(&lockStats.wait[fop][i], 0);
+            atomic64_set(&lockStats.hold[fop][i], 0);
+        }
+    }
+    return len;
+}
+
+static const struct file_operations lock_stats_reset_fops = {
+  .owner = THIS_MODULE,
+  .write = lock_stats_reset,
+};
+
+static void lock_stats_init(struct dentry* dir) {
+    debugfs_create_file("lock_stats", 0444, dir, NULL, &lock_stats_fops);
+    debugfs_create_file("lock_stats_reset", 0200, dir, NULL, &lock_stats_reset_fops);
+}
+
+#endif
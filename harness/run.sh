@@ -0,0 +1,128 @@
+#!/bin/bash
+# Builds every module and the skull tools, boots them in QEMU with a busybox initramfs
+# and collects what the guest reports. See Readme.md in this folder.
+#
+#   KDIR=~/linux ./harness/run.sh
+#
+# KDIR        built kernel tree, with arch/x86/boot/bzImage and ready for out of tree modules
+# BUSYBOX     static busybox, the one in PATH if not set
+# OUT         where everything goes, ./harness-out by default
+# BENCH_ARGS  arguments for 12_adding_ioctl/bench, a small grid by default
+# BASELINE    bench.csv of an earlier run, mb_s drops bigger than THRESHOLD percent fail the run
+# ACCEL       kvm or tcg, kvm when /dev/kvm can be used
+# SMP MEM TIMEOUT   vcpus, memory and seconds before the VM is killed
+
+set -u
+
+repo=$(cd "$(dirname "$0")/.." && pwd)
+KDIR=${KDIR:?set KDIR to a built kernel tree}
+BUSYBOX=${BUSYBOX:-$(command -v busybox)}
+OUT=${OUT:-$PWD/harness-out}
+BENCH_ARGS=${BENCH_ARGS:--n 5000 -q 512,4096 -Q 1000 -i 512,4096 -m 100,0}
+BASELINE=${BASELINE:-}
+THRESHOLD=${THRESHOLD:-10}
+SMP=${SMP:-2}
+MEM=${MEM:-1G}
+TIMEOUT=${TIMEOUT:-900}
+if [ -z "${ACCEL:-}" ]; then
+    ACCEL=tcg
+    [ -w /dev/kvm ] && ACCEL=kvm
+fi
+
+die() {
+    echo "harness: $*" >&2
+    exit 1
+}
+
+[ -f "$KDIR/arch/x86/boot/bzImage" ] || die "no bzImage in $KDIR"
+[ -x "$BUSYBOX" ] || die "no busybox, set BUSYBOX"
+file -L "$BUSYBOX" | grep -q "statically linked" || die "$BUSYBOX is not static"
+command -v qemu-system-x86_64 > /dev/null || die "no qemu-system-x86_64"
+
+rm -rf "$OUT"
+mkdir -p "$OUT/src" "$OUT/root"
+root=$OUT/root
+
+# build in a copy, so the tree stays clean
+echo "harness: building modules against $KDIR"
+# the modules include ../common, so it goes next to them
+cp -r "$repo/common" "$OUT/src/common"
+for dir in "$repo"/[0-9][0-9]_*/; do
+    name=$(basename "$dir")
+    grep -q "obj-m" "$dir/Makefile" 2> /dev/null || continue
+    cp -r "$dir" "$OUT/src/$name"
+    if ! make -C "$OUT/src/$name" KERNELDIR="$KDIR" > "$OUT/src/$name.build.log" 2>&1; then
+        die "$name did not build, see $OUT/src/$name.build.log"
+    fi
+done
+
+# the guest has no libc, the tools go in static
+skull=$OUT/src/12_adding_ioctl
+gcc -O2 -static -o "$skull/test" "$skull/test.c" || die "test.c did not build"
+gcc -O2 -static -o "$skull/bench" "$skull/bench.c" || die "bench.c did not build"
+gcc -O2 -static -o "$skull/replay" "$skull/replay.c" -lpthread || die "replay.c did not build"
+gcc -O2 -static -o "$skull/libskull_test" "$skull/libskull_test.c" "$skull/libskull.c" || die "libskull_test.c did not build"
+# the BPF scan needs clang and a static libbpf, without them the guest skips it
+scan=
+if command -v clang > /dev/null &&
+    clang -O2 -g -target bpf -c "$skull/skull_scan.bpf.c" -o "$skull/skull_scan.bpf.o" 2> "$skull/scan.build.log" &&
+    gcc -O2 -static -o "$skull/skull_scan" "$skull/skull_scan.c" -lbpf -lelf -lz 2>> "$skull/scan.build.log"; then
+    scan="$skull/skull_scan $skull/skull_scan.bpf.o"
+else
+    echo "harness: no clang or static libbpf, the BPF scan won't run"
+fi
+
+mkdir -p "$root"/{bin,sbin,usr/bin,usr/sbin,etc,proc,sys,dev,tmp,work}
+cp "$BUSYBOX" "$root/bin/busybox"
+ln -s busybox "$root/bin/sh"
+# the load scripts ask for bash, busybox's sh runs them fine
+ln -s busybox "$root/bin/bash"
+echo "root:x:0:" > "$root/etc/group"
+echo "staff:x:50:" >> "$root/etc/group"
+cp "$repo/harness/init" "$root/init"
+chmod +x "$root/init"
+for dir in "$OUT"/src/[0-9][0-9]_*/; do
+    name=$(basename "$dir")
+    mkdir -p "$root/work/$name"
+    cp "$dir"/*.ko "$dir"/*_load.sh "$root/work/$name/" 2> /dev/null
+done
+cp "$skull/test" "$skull/bench" "$skull/replay" "$skull/libskull_test" $scan "$root/work/12_adding_ioctl/"
+echo "BENCH_ARGS=\"$BENCH_ARGS\"" > "$root/work/harness.conf"
+(cd "$root" && find . | cpio -o -H newc --quiet | gzip) > "$OUT/initramfs.gz"
+
+echo "harness: booting with $ACCEL, the guest console is in $OUT/console.log"
+accel="-accel tcg"
+[ "$ACCEL" = kvm ] && accel="-accel kvm -cpu host"
+# ttyS0 is the console, ttyS1 is where the guest writes the report
+timeout "$TIMEOUT" qemu-system-x86_64 $accel -smp "$SMP" -m "$MEM" \
+    -kernel "$KDIR/arch/x86/boot/bzImage" -initrd "$OUT/initramfs.gz" \
+    -append "console=ttyS0 loglevel=4 panic=-1 oops=panic" \
+    -nographic -no-reboot -nic none \
+    -serial file:"$OUT/console.log" -serial file:"$OUT/report.txt" \
+    -monitor none < /dev/null
+rc=$?
+[ $rc -eq 124 ] && echo "harness: the VM did not finish in ${TIMEOUT}s"
+
+awk '/^=== bench csv ===/ { on = 1; next } /^=== / { on = 0 } on' "$OUT/report.txt" > "$OUT/bench.csv" 2> /dev/null
+result=$(grep "^RESULT" "$OUT/report.txt" 2> /dev/null)
+[ -n "$result" ] || die "no result from the guest, see $OUT/console.log"
+grep "^FAIL" "$OUT/report.txt"
+echo "harness: $result, report in $OUT/report.txt"
+status=0
+echo "$result" | grep -q "failures=0" || status=1
+
+# same run = first six columns, mb_s is the tenth
+if [ -n "$BASELINE" ]; then
+    awk -F, -v t="$THRESHOLD" '
+        FNR == 1 { next }
+        NR == FNR { base[$1","$2","$3","$4","$5","$6] = $10; next }
+        {
+            k = $1","$2","$3","$4","$5","$6
+            if (!(k in base) || base[k] <= 0) next
+            drop = 100 * (base[k] - $10) / base[k]
+            if (drop > t) { printf("REGRESSION %s %.1f -> %.1f MB/s (-%.0f%%)\n", k, base[k], $10, drop); bad = 1 }
+        }
+        END { exit bad }' "$BASELINE" "$OUT/bench.csv" | tee "$OUT/regressions.txt"
+    [ "${PIPESTATUS[0]}" -eq 0 ] || status=1
+fi
+exit $status